@@ -0,0 +1,841 @@
+#include "pch.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <iterator>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "inline_hooks.h"
+#include "intercept_manager.h"
+#include "object_manager.h"
+#include "packet_layouts.h"
+#include "packet_processor.h"
+#include "packet_registry.h"
+#include "packet_schema.h"
+#include "packet_structures.h"
+#include "packet_writer.h"
+#include "player.h"
+#include "sprite_columns.h"
+#include "string_interner.h"
+#include "task_pool.h"
+#include "worker.h"
+
+// Micro-benchmarks for the packet pipeline. Each one times the structure the
+// pipeline uses now against the one it replaced, on the same input, and
+// prints nanoseconds per operation, or latency percentiles and allocations
+// where the tail is what matters. Run the Release build with nothing else
+// busy; the numbers are only meaningful relative to each other.
+//
+//   bench.exe            every benchmark
+//   bench.exe ring pool  only those named
+
+task_pool bench_scheduler;
+task_pool &scheduler = bench_scheduler;
+
+namespace
+{
+    // Counted by the operator new below, per thread, so a benchmark can see
+    // what the path it times allocates.
+    thread_local uint64_t thread_allocations = 0;
+}
+
+void *operator new(size_t size)
+{
+    ++thread_allocations;
+    if (void *p = std::malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+    using bench_clock = std::chrono::steady_clock;
+
+    // Keeps the optimiser from discarding work whose result is unused.
+    std::atomic<uint64_t> sink{0};
+
+    // Packets the benchmark handlers have seen.
+    std::atomic<uint64_t> handled{0};
+
+    decode_error bench_handler(const packet &)
+    {
+        handled.fetch_add(1, std::memory_order_release);
+        return decode_error::none;
+    }
+
+    template <typename Work>
+    double ns_per_op(size_t iterations, Work &&work)
+    {
+        work(iterations / 10 + 1);
+        const auto start = bench_clock::now();
+        work(iterations);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start);
+        return static_cast<double>(elapsed.count()) / static_cast<double>(iterations);
+    }
+
+    // Sorts part of samples; call it for the lower fraction first.
+    uint64_t percentile(std::vector<uint32_t> &samples, double fraction)
+    {
+        if (samples.empty())
+            return 0;
+        const auto at = samples.begin() + (std::min)(static_cast<size_t>(fraction * static_cast<double>(samples.size())), samples.size() - 1);
+        std::nth_element(samples.begin(), at, samples.end());
+        return *at;
+    }
+
+    void report(const char *name, const char *baseline, double before, const char *current, double after)
+    {
+        std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(22) << baseline << std::setw(9) << before << " ns"
+                  << std::setw(22) << current << std::setw(9) << after << " ns"
+                  << std::setw(8) << before / after << "x" << std::endl;
+    }
+
+    std::vector<BYTE> sample_payload(size_t length)
+    {
+        std::vector<BYTE> bytes(length);
+        for (size_t i = 0; i < length; ++i)
+            bytes[i] = static_cast<BYTE>(i * 31 + 7);
+        return bytes;
+    }
+
+    // The capture path before pooling: a packet owning a new[] copy of the
+    // bytes, shared through make_shared and handed to a ThreadSafeQueue
+    // drained by its own thread, as RecvFunctionStub and the old
+    // PacketProcessor did it.
+    struct heap_packet
+    {
+        BYTE *data;
+        size_t length;
+
+        heap_packet(const BYTE *bytes, size_t count) : data(new BYTE[count]), length(count)
+        {
+            std::copy(bytes, bytes + count, data);
+        }
+
+        ~heap_packet()
+        {
+            delete[] data;
+        }
+
+        heap_packet(const heap_packet &) = delete;
+        heap_packet &operator=(const heap_packet &) = delete;
+    };
+
+    struct enqueue_cost
+    {
+        double allocations;
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+    };
+
+    // Times every enqueue(i) for count packets. Packets go in bursts, as a
+    // map load delivers them, and the next burst waits for the consumer to
+    // catch up so a full queue never turns into drops.
+    template <typename Enqueue>
+    enqueue_cost time_enqueues(size_t count, size_t burst, Enqueue &&enqueue)
+    {
+        std::vector<uint32_t> samples;
+        samples.reserve(count);
+        handled.store(0);
+
+        const uint64_t allocationsBefore = thread_allocations;
+        for (size_t done = 0; done < count;)
+        {
+            for (const size_t end = (std::min)(done + burst, count); done < end; ++done)
+            {
+                const auto start = bench_clock::now();
+                enqueue(done);
+                samples.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count()));
+            }
+            while (handled.load(std::memory_order_acquire) < done)
+                std::this_thread::yield();
+        }
+        const uint64_t allocations = thread_allocations - allocationsBefore;
+
+        return enqueue_cost{static_cast<double>(allocations) / static_cast<double>(count),
+                            percentile(samples, 0.5), percentile(samples, 0.99)};
+    }
+
+    void report_enqueue(const char *name, const char *path, const enqueue_cost &cost)
+    {
+        std::cout << std::left << std::setw(10) << name << std::setw(22) << path << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(8) << cost.allocations << " allocs/pkt"
+                  << std::setw(8) << cost.p50_ns << " ns p50" << std::setw(8) << cost.p99_ns << " ns p99" << std::endl;
+    }
+
+    // A million synthetic packets of mixed sizes from the hook into the
+    // pipeline: allocations made on the hook thread and enqueue latency.
+    void bench_capture()
+    {
+        constexpr uint8_t opcode = 0x98;
+        constexpr size_t count = 1000000;
+        constexpr size_t burst = 256;
+        PacketHandlerRegistry::register_recv_handlers(opcode, bench_handler);
+
+        std::vector<std::vector<BYTE>> payloads;
+        for (const size_t length : {12, 32, 96, 180})
+        {
+            payloads.push_back(sample_payload(length));
+            payloads.back()[0] = opcode;
+        }
+
+        ThreadSafeQueue<std::shared_ptr<heap_packet>> queue;
+        std::thread consumer([&queue]
+                             {
+            for (;;)
+            {
+                std::shared_ptr<heap_packet> pkt;
+                queue.wait_and_pop(pkt);
+                if (pkt == nullptr)
+                    return;
+                sink.fetch_add(pkt->data[pkt->length - 1], std::memory_order_relaxed);
+                handled.fetch_add(1, std::memory_order_release);
+            } });
+        const auto before = time_enqueues(count, burst, [&](size_t i)
+                                          {
+            const auto &bytes = payloads[i % payloads.size()];
+            queue.push(std::make_shared<heap_packet>(bytes.data(), bytes.size())); });
+        queue.push(nullptr);
+        consumer.join();
+
+        // Lanes have no way to stop, so the processor lives until exit.
+        static PacketProcessor processor(scheduler);
+        const auto after = time_enqueues(count, burst, [&](size_t i)
+                                         {
+            const auto &bytes = payloads[i % payloads.size()];
+            processor.enqueueRecv(packet(bytes.data(), bytes.size())); });
+
+        report_enqueue("capture", "make_shared + new[]", before);
+        report_enqueue("capture", "pooled PacketProcessor", after);
+    }
+
+    // Stands in for the client's send routine, which encrypts the buffer in
+    // place. The real one needs the game's sender object.
+    void client_send(BYTE *bytes, size_t length)
+    {
+        for (size_t i = 0; i < length; ++i)
+            bytes[i] ^= 0x5A;
+        sink.fetch_add(bytes[0], std::memory_order_relaxed);
+    }
+
+    // The writer before the inline buffer: a growing vector behind a
+    // shared_mutex that every write takes, sent through send_to_server's
+    // code cave, a freshly committed page the bytes are copied into. Its
+    // hex dump of every packet is left out; it would swamp the rest.
+    class legacy_writer
+    {
+    private:
+        std::vector<BYTE> data;
+        mutable std::shared_mutex mutex;
+
+    public:
+        template <typename T>
+        void write(const T &value)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            BYTE valueBytes[sizeof(T)];
+            for (size_t i = 0; i < sizeof(T); ++i)
+                valueBytes[i] = static_cast<BYTE>((value >> (8 * (sizeof(T) - 1 - i))) & 0xFF);
+            data.insert(data.end(), valueBytes, valueBytes + sizeof(T));
+        }
+
+        void writeString8(const std::string &str)
+        {
+            write<BYTE>(static_cast<BYTE>(str.length()));
+            const std::vector<BYTE> bytes(str.begin(), str.end());
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            data.insert(data.end(), bytes.begin(), bytes.end());
+        }
+
+        void sendToServer()
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            if (data.empty())
+                return;
+            void *cave = VirtualAlloc(nullptr, data.size(), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            std::memcpy(cave, data.data(), data.size());
+            client_send(static_cast<BYTE *>(cave), data.size());
+            VirtualFree(cave, 0, MEM_RELEASE);
+        }
+    };
+
+    // Building and sending each packet of a cast, as spell_manager does:
+    // the hand-written writes into the old writer against the schema
+    // encoding into PacketWriter, whose own buffer goes to the client.
+    void bench_writer()
+    {
+        constexpr size_t iterations = 500000;
+        const std::string spell = "beag ioc fein";
+        const name_id spellName = interned_names.intern(spell);
+
+        const auto send = [](PacketWriter &&writer)
+        {
+            client_send(const_cast<BYTE *>(writer.data()), writer.getSize());
+            writer.reset();
+        };
+
+        double before = ns_per_op(iterations, [](size_t n)
+                                  {
+            for (size_t i = 0; i < n; ++i)
+            {
+                legacy_writer out;
+                out.write<BYTE>(0x4D);
+                out.write<BYTE>(static_cast<BYTE>(i & 7));
+                out.write<BYTE>(0x00);
+                out.sendToServer();
+            } });
+        double after = ns_per_op(iterations, [&send](size_t n)
+                                 {
+            for (size_t i = 0; i < n; ++i)
+            {
+                PacketWriter out;
+                schema::encode<layouts::cast_lines>(out, {static_cast<BYTE>(i & 7)});
+                send(std::move(out));
+            } });
+        report("writer 4D", "vector + lock + cave", before, "PacketWriter", after);
+
+        before = ns_per_op(iterations, [&spell](size_t n)
+                           {
+            for (size_t i = 0; i < n; ++i)
+            {
+                legacy_writer out;
+                out.write<BYTE>(0x4E);
+                out.writeString8(spell);
+                out.write<BYTE>(0x00);
+                out.sendToServer();
+            } });
+        after = ns_per_op(iterations, [&send, spellName](size_t n)
+                          {
+            for (size_t i = 0; i < n; ++i)
+            {
+                PacketWriter out;
+                schema::encode<layouts::cast_chant>(out, {interned_names.view(spellName)});
+                send(std::move(out));
+            } });
+        report("writer 4E", "vector + lock + cave", before, "PacketWriter", after);
+
+        before = ns_per_op(iterations, [](size_t n)
+                           {
+            for (size_t i = 0; i < n; ++i)
+            {
+                legacy_writer out;
+                out.write<BYTE>(0x0F);
+                out.write<BYTE>(static_cast<BYTE>(i));
+                out.write<unsigned int>(static_cast<unsigned int>(i));
+                out.write<USHORT>(12);
+                out.write<USHORT>(34);
+                out.sendToServer();
+            } });
+        after = ns_per_op(iterations, [&send](size_t n)
+                          {
+            for (size_t i = 0; i < n; ++i)
+            {
+                PacketWriter out;
+                schema::encode<layouts::cast_spell>(out, {static_cast<BYTE>(i), static_cast<unsigned int>(i), 12, 34});
+                send(std::move(out));
+            } });
+        report("writer 0F", "vector + lock + cave", before, "PacketWriter", after);
+    }
+
+    // x07 sprite lists from a crowded screen to a full map load, a third of
+    // the entries NPCs: the schema's array-of-structs decode against the
+    // column decoder.
+    void bench_sprites()
+    {
+        for (const size_t entries : {10, 50, 100, 200, 500})
+        {
+            std::mt19937 random(7);
+            SpriteList list;
+            std::vector<std::string> names;
+            names.reserve(entries);
+            for (size_t i = 0; i < entries; ++i)
+            {
+                SpriteEntry entry{};
+                entry.X = static_cast<USHORT>(random());
+                entry.Y = static_cast<USHORT>(random());
+                entry.Serial = random();
+                entry.Image = static_cast<USHORT>(i % 3 == 0 ? 0x4000 + random() % 0x4001 : random() % 0x4000);
+                entry.Color = static_cast<BYTE>(random());
+                entry.Display = static_cast<USHORT>(random());
+                if (entry.Image >= 0x4000 && entry.Image <= 0x8000)
+                {
+                    entry.Type = 2;
+                    names.push_back("npc" + std::to_string(i));
+                    entry.Name = names.back();
+                }
+                list.Entries.push_back(entry);
+            }
+            PacketWriter writer;
+            schema::encode<layouts::sprite_list>(writer, list);
+            const packet pkt(writer.data(), writer.getSize());
+            const size_t iterations = 10000000 / entries;
+
+            const double before = ns_per_op(iterations, [&](size_t n)
+                                            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    SpriteList decoded;
+                    schema::decode_into<layouts::sprite_list>(pkt, decoded);
+                    sink.fetch_add(decoded.Entries.size(), std::memory_order_relaxed);
+                } });
+            SpriteColumns columns;
+            const double after = ns_per_op(iterations, [&](size_t n)
+                                           {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    sprite_list_decoder::decode(pkt, columns);
+                    sink.fetch_add(columns.size(), std::memory_order_relaxed);
+                } });
+            const std::string name = "x07/" + std::to_string(entries);
+            report(name.c_str(), "schema decode", before, "SpriteColumns", after);
+        }
+    }
+
+    template <typename T>
+    void typed_consumer(const T &value)
+    {
+        sink.fetch_add(value.Serial, std::memory_order_relaxed);
+    }
+
+    // One opcode dispatched to 1 to 8 consumers: chain subscribers that each
+    // decode the raw bytes, as every consumer besides the handler used to,
+    // against typed subscribers sharing the registry's single decode.
+    template <typename Layout>
+    void bench_consumers(const char *name, const typename Layout::type &value)
+    {
+        constexpr size_t iterations = 200000;
+        constexpr size_t counts[] = {1, 2, 4, 8};
+
+        PacketWriter writer;
+        schema::encode<Layout>(writer, value);
+        const packet pkt(writer.data(), writer.getSize());
+        const auto dispatch = [&pkt](size_t n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                PacketHandlerRegistry::handle_incoming_data(pkt);
+                PacketHandlerRegistry::retire_batch();
+            }
+        };
+
+        std::array<double, std::size(counts)> before{};
+        std::vector<subscription_id> chained;
+        for (size_t c = 0; c < std::size(counts); ++c)
+        {
+            while (chained.size() < counts[c])
+            {
+                chained.push_back(PacketHandlerRegistry::subscribe_chain(packet_direction::recv, Layout::opcode, 0, [](const packet &raw)
+                                                                         {
+                    typename Layout::type decoded{};
+                    schema::decode_into<Layout>(raw, decoded);
+                    sink.fetch_add(decoded.Serial, std::memory_order_relaxed);
+                    return chain_result::next; }));
+            }
+            before[c] = ns_per_op(iterations, dispatch);
+        }
+        for (const auto id : chained)
+            PacketHandlerRegistry::unsubscribe_chain(id);
+
+        size_t typed = 0;
+        for (size_t c = 0; c < std::size(counts); ++c)
+        {
+            for (; typed < counts[c]; ++typed)
+                PacketHandlerRegistry::subscribe_recv<Layout>(typed_consumer<typename Layout::type>);
+            const double after = ns_per_op(iterations, dispatch);
+            const std::string label = std::string(name) + " x" + std::to_string(counts[c]);
+            report(label.c_str(), "decode per consumer", before[c], "decode once", after);
+        }
+    }
+
+    // Typed subscribers stay registered, so this runs before the shard
+    // benchmark routes its own x0C traffic.
+    void bench_subscribers()
+    {
+        const EntityWalk walk{0x01020304, 120, 45, Direction::East};
+        bench_consumers<layouts::entity_walk>("x0C", walk);
+
+        PlayerAppearance appearance{};
+        appearance.X = 120;
+        appearance.Y = 45;
+        appearance.Serial = 0x01020304;
+        appearance.Head = 0x0012;
+        appearance.Armor = 0x0140;
+        appearance.Weapon = 0x0021;
+        appearance.Name = interned_names.intern("Bench");
+        bench_consumers<layouts::player_appearance>("x33", appearance);
+    }
+
+    // What the consumer side of a hand-off saw: packets taken, and for each
+    // probe the time from just before its push to the consumer taking it.
+    struct handoff_consumer
+    {
+        static constexpr BYTE probe = 0x01;
+
+        std::atomic<uint64_t> consumed{0};
+        std::atomic<int64_t> pushedAt{0};
+        std::vector<uint32_t> wakes;
+
+        void take(const packet &pkt)
+        {
+            if (pkt.data[0] == probe)
+            {
+                const auto now = bench_clock::now().time_since_epoch().count();
+                wakes.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                          bench_clock::duration(now - pushedAt.load(std::memory_order_acquire)))
+                                                          .count()));
+            }
+            consumed.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    // Drives push() from this thread while consumer drains on another. First
+    // bursts of 64 packets 20us apart, timing each push while the consumer
+    // is busy with the previous burst; then single probes sent to an idle
+    // consumer, timing how long it takes to wake and see them. push returns
+    // false for a packet it dropped.
+    template <typename Push>
+    void time_handoff(const char *path, handoff_consumer &consumer, Push &&push)
+    {
+        constexpr size_t bursts = 2000;
+        constexpr size_t burst = 64;
+        constexpr size_t probes = 2000;
+
+        auto bytes = sample_payload(32);
+        bytes[0] = 0x02;
+        std::vector<uint32_t> pushes;
+        pushes.reserve(bursts * burst);
+        consumer.wakes.clear();
+        consumer.wakes.reserve(probes);
+        consumer.consumed.store(0);
+
+        uint64_t sent = 0;
+        uint64_t dropped = 0;
+        for (size_t b = 0; b < bursts; ++b)
+        {
+            // The consumer may fall one burst behind, no more: it is still
+            // busy while the next burst goes in, and the ring never fills.
+            while (consumer.consumed.load(std::memory_order_acquire) + burst < sent)
+                std::this_thread::yield();
+
+            for (size_t i = 0; i < burst; ++i)
+            {
+                packet pkt(bytes.data(), bytes.size());
+                const auto start = bench_clock::now();
+                const bool accepted = push(std::move(pkt));
+                (accepted ? sent : dropped) += 1;
+                pushes.push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count()));
+            }
+            const auto until = bench_clock::now() + std::chrono::microseconds(20);
+            while (bench_clock::now() < until)
+            {
+            }
+        }
+
+        bytes[0] = handoff_consumer::probe;
+        for (size_t p = 0; p < probes; ++p)
+        {
+            while (consumer.consumed.load(std::memory_order_acquire) < sent)
+                std::this_thread::yield();
+            // Long enough for the consumer to give up spinning and block.
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+            packet pkt(bytes.data(), bytes.size());
+            consumer.pushedAt.store(bench_clock::now().time_since_epoch().count(), std::memory_order_release);
+            (push(std::move(pkt)) ? sent : dropped) += 1;
+        }
+        while (consumer.consumed.load(std::memory_order_acquire) < sent)
+            std::this_thread::yield();
+
+        std::cout << std::left << std::setw(10) << "ring" << std::setw(22) << path << std::right
+                  << " push" << std::setw(7) << percentile(pushes, 0.5) << "/" << std::setw(6) << percentile(pushes, 0.99) << " ns"
+                  << "  wake" << std::setw(8) << percentile(consumer.wakes, 0.5) << "/" << std::setw(7) << percentile(consumer.wakes, 0.99)
+                  << " ns (p50/p99)";
+        if (dropped != 0)
+            std::cout << ", " << dropped << " dropped";
+        std::cout << std::endl;
+    }
+
+    // The hand-off between the hook and a lane, producer and consumer on
+    // separate threads: the ThreadSafeQueue the pipeline used, drained by a
+    // thread blocked in wait_and_pop, against a PacketChannel whose drain
+    // task is posted to the pool when a push finds it idle.
+    void bench_ring()
+    {
+        // The consumers and the channel outlive the benchmark: a drain task
+        // may still be releasing the channel after its last packet.
+        static handoff_consumer queued;
+        static ThreadSafeQueue<packet> queue;
+        std::thread blocked([]
+                            {
+            for (;;)
+            {
+                packet pkt;
+                queue.wait_and_pop(pkt);
+                if (pkt.length == 0)
+                    return;
+                queued.take(pkt);
+            } });
+        time_handoff("ThreadSafeQueue", queued, [](packet pkt)
+                     {
+            queue.push(std::move(pkt));
+            return true; });
+        queue.push(packet());
+        blocked.join();
+
+        static handoff_consumer drained;
+        static PacketChannel<packet, PacketProcessor::channel_capacity> channel;
+        channel.set_schedule([]
+                             { scheduler.post([]
+                                              {
+                do
+                {
+                    channel.drain([](packet &pkt)
+                                  { drained.take(pkt); });
+                } while (channel.release()); }); });
+        time_handoff("PacketChannel", drained, [](packet pkt)
+                     { return channel.push(std::move(pkt)); });
+    }
+
+    // Everyone on screen walking: 20000 x0C updates across 1000 serials on
+    // the real entity route, decoded once and applied as recv_on_entity_walk
+    // applies them, through a player_manager holding the same 1000 players.
+    // One shard against the default shard count. Every update must be
+    // handled to be timed, so x0C never drops here rather than coalescing
+    // as it does in the DLL.
+    GenericObjectManager<Player, unsigned int> walkers;
+
+    void on_walk(const EntityWalk &walk)
+    {
+        walkers.GetAndApplyAction(walk.Serial, [&walk](Player *player)
+                                  {
+            if (player != nullptr)
+            {
+                player->SetLocation(Location(walk.X, walk.Y));
+                player->SetDirection(walk.Facing);
+            } });
+        handled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void bench_shards()
+    {
+        constexpr uint32_t serials = 1000;
+        constexpr size_t updates = 20000;
+        constexpr size_t walk_size = 10;
+
+        for (uint32_t serial = 1; serial <= serials; ++serial)
+        {
+            Player player;
+            player.SetSerial(serial);
+            walkers.AddOrUpdate(serial, player);
+        }
+
+        PacketHandlerRegistry::subscribe_recv<layouts::entity_walk>(on_walk);
+        PacketHandlerRegistry::set_dispatch_order(packet_direction::recv, 0x0C, dispatch_order::entity);
+        PacketHandlerRegistry::set_serial_offset(packet_direction::recv, 0x0C, 1);
+        PacketHandlerRegistry::set_overload_policy(packet_direction::recv, 0x0C, overload_policy::never_drop);
+
+        std::vector<BYTE> walks;
+        walks.reserve(updates * walk_size);
+        for (size_t i = 0; i < updates; ++i)
+        {
+            const EntityWalk walk{static_cast<unsigned int>(i % serials + 1), static_cast<USHORT>(i % 100), static_cast<USHORT>(i / 100 % 100),
+                                  static_cast<Direction>(i % 4)};
+            PacketWriter writer;
+            schema::encode<layouts::entity_walk>(writer, walk);
+            walks.insert(walks.end(), writer.data(), writer.data() + writer.getSize());
+        }
+
+        // Lanes have no way to stop, so the processors live until exit rather
+        // than being torn down under a draining task.
+        static PacketProcessor one_shard(scheduler, 1);
+        static PacketProcessor default_shards(scheduler);
+
+        const auto run = [&walks](PacketProcessor &processor)
+        {
+            handled.store(0);
+            const auto start = bench_clock::now();
+            for (size_t i = 0; i < updates; ++i)
+                processor.enqueueRecv(packet(walks.data() + i * walk_size, walk_size));
+            while (handled.load(std::memory_order_relaxed) < updates)
+                std::this_thread::yield();
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start);
+            return static_cast<double>(elapsed.count()) / updates;
+        };
+
+        const double before = run(one_shard);
+        const double after = run(default_shards);
+        report("shards", "1 shard", before, "default shards", after);
+    }
+
+    // Time from post() to the task starting on a pool worker, with posts
+    // spaced 20us apart as packets arrive in combat.
+    void bench_pool()
+    {
+        constexpr int posts = 5000;
+        const auto wake_latency = [](wait_mode mode)
+        {
+            scheduler.set_wait_mode(mode);
+            std::atomic<int64_t> total{0};
+            std::atomic<int> done{0};
+            for (int i = 0; i < posts; ++i)
+            {
+                const auto posted = bench_clock::now();
+                scheduler.post([&total, &done, posted]
+                               {
+                    total.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - posted).count(), std::memory_order_relaxed);
+                    done.fetch_add(1, std::memory_order_release); });
+                const auto until = bench_clock::now() + std::chrono::microseconds(20);
+                while (bench_clock::now() < until)
+                {
+                }
+            }
+            while (done.load(std::memory_order_acquire) < posts)
+                std::this_thread::yield();
+            return static_cast<double>(total.load()) / posts;
+        };
+
+        const double before = wake_latency(wait_mode::park);
+        const double after = wake_latency(wait_mode::adaptive);
+        report("pool", "park on empty", before, "spin/yield/park", after);
+    }
+
+    hook_verdict pass_hook(inline_packet &pkt)
+    {
+        sink.fetch_add(pkt.opcode(), std::memory_order_relaxed);
+        return hook_verdict::pass;
+    }
+
+    // What the inline stage adds to the game's network thread per packet:
+    // an opcode with no hook, which is every packet unless one is
+    // registered, and an opcode with one hook that passes.
+    void bench_inline()
+    {
+        constexpr size_t iterations = 2000000;
+        constexpr BYTE hooked = 0x97;
+        inline_hooks::add(packet_direction::recv, hooked, pass_hook);
+
+        auto bytes = sample_payload(32);
+        const auto run = [&bytes](BYTE opcode)
+        {
+            return ns_per_op(iterations, [&bytes, opcode](size_t n)
+                             {
+                bytes[0] = opcode;
+                for (size_t i = 0; i < n; ++i)
+                {
+                    int length = static_cast<int>(bytes.size());
+                    sink.fetch_add(static_cast<uint64_t>(inline_hooks::run(packet_direction::recv, bytes.data(), length)), std::memory_order_relaxed);
+                } });
+        };
+
+        const double bare = run(0x96);
+        const double one = run(hooked);
+        inline_hooks::remove(packet_direction::recv, hooked, pass_hook);
+
+        std::cout << std::left << std::setw(10) << "inline" << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(22) << "no hook" << std::setw(9) << bare << " ns"
+                  << std::setw(22) << "one hook" << std::setw(9) << one << " ns" << std::endl;
+    }
+
+    // Finding and running an opcode's handler: the hash map the registry
+    // used to hold against a 256-entry table laid out as the registry's is.
+    // The dispatch row is the registry's whole path, which also keeps the
+    // per-opcode counters and latency histograms.
+    void bench_registry()
+    {
+        constexpr uint8_t opcode = 0x99;
+        constexpr size_t iterations = 2000000;
+        PacketHandlerRegistry::register_recv_handlers(opcode, bench_handler);
+
+        const BYTE bytes[] = {opcode, 1, 2, 3};
+        packet pkt(bytes, sizeof(bytes));
+        pkt.stamp(1, packet_direction::recv);
+
+        std::unordered_map<uint8_t, PacketHandlerFunc> handlers;
+        for (int i = 0; i < 24; ++i)
+            handlers[static_cast<uint8_t>(i * 7)] = bench_handler;
+        handlers[opcode] = bench_handler;
+
+        static std::array<std::atomic<PacketHandlerFunc>, 256> table{};
+        for (const auto &[op, handler] : handlers)
+            table[op].store(handler, std::memory_order_release);
+
+        const double before = ns_per_op(iterations, [&](size_t n)
+                                        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (const auto it = handlers.find(pkt.data[0]); it != handlers.end())
+                    it->second(pkt);
+            } });
+        const double after = ns_per_op(iterations, [&](size_t n)
+                                       {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (const auto handler = table[pkt.data[0]].load(std::memory_order_acquire))
+                    handler(pkt);
+            } });
+        report("registry", "unordered_map", before, "opcode table", after);
+
+        const double dispatch = ns_per_op(iterations, [&](size_t n)
+                                          {
+            for (size_t i = 0; i < n; ++i)
+                PacketHandlerRegistry::handle_incoming_data(pkt); });
+        report("dispatch", "unordered_map", before, "registry dispatch", dispatch);
+    }
+
+    struct benchmark
+    {
+        const char *name;
+        void (*run)();
+    };
+
+    constexpr benchmark benchmarks[] = {
+        {"capture", bench_capture},
+        {"writer", bench_writer},
+        {"sprites", bench_sprites},
+        {"subscribers", bench_subscribers},
+        {"ring", bench_ring},
+        {"shards", bench_shards},
+        {"pool", bench_pool},
+        {"inline", bench_inline},
+        {"registry", bench_registry},
+    };
+}
+
+int main(int argc, char **argv)
+{
+    scheduler.start();
+
+    for (const auto &b : benchmarks)
+    {
+        bool wanted = argc < 2;
+        for (int i = 1; i < argc; ++i)
+            wanted = wanted || std::string(argv[i]) == b.name;
+        if (wanted)
+            b.run();
+    }
+
+    std::cout << "(checksum " << sink.load() << ")" << std::endl;
+    scheduler.shutdown();
+    return 0;
+}
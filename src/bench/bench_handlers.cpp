@@ -0,0 +1,42 @@
+#include "pch.h"
+#include "intercept_manager.h"
+#include "packet_handler.h"
+#include "packet_registry.h"
+
+// The dispatch tables in handle_registry.cpp are compiled from the built-in
+// handlers. The benchmarks dispatch only opcodes they register themselves,
+// so the built-in ones are stubbed here rather than pulling in the game
+// state they touch.
+
+decode_error send_handle_packet_x1C(const packet &) { return decode_error::none; }
+decode_error send_handle_packet_x38(const packet &) { return decode_error::none; }
+decode_error send_handle_packet_x10(const packet &) { return decode_error::none; }
+decode_error send_handle_packet_x0F(const packet &) { return decode_error::none; }
+decode_error send_handle_packet_x13(const packet &) { return decode_error::none; }
+decode_error send_handle_packet_x06(const packet &) { return decode_error::none; }
+
+decode_error recv_handle_packet_x04(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x0B(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x17(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x0E(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x3A(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x07(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x29(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x15(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x39(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x10(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x18(const packet &) { return decode_error::none; }
+decode_error recv_handle_packet_x0F(const packet &) { return decode_error::none; }
+
+// The lanes dispatch through intercept_manager as they do in the DLL.
+void __stdcall intercept_manager::on_packet_send(packet *packet)
+{
+    if (packet != nullptr && packet->length >= 2)
+        PacketHandlerRegistry::handle_outgoing_data(*packet);
+}
+
+void __stdcall intercept_manager::on_packet_recv(packet *packet)
+{
+    if (packet != nullptr && packet->length >= 2)
+        PacketHandlerRegistry::handle_incoming_data(*packet);
+}
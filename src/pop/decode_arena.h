@@ -0,0 +1,97 @@
+#pragma once
+#include "pch.h"
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Bump allocator for packets decoded during one dispatch batch. Everything
+// made from it dies together when the batch is retired, so subscribers can
+// hold a const reference for the whole batch and nothing is freed per packet.
+// Blocks are kept across batches; after warm-up a batch allocates nothing.
+//
+// An arena belongs to the dispatch thread that owns the batch.
+class decode_arena
+{
+public:
+    static constexpr size_t block_bytes = 16 * 1024;
+
+    decode_arena() = default;
+    decode_arena(const decode_arena &) = delete;
+    decode_arena &operator=(const decode_arena &) = delete;
+
+    ~decode_arena()
+    {
+        reset();
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+        void *memory = allocate(sizeof(T), alignof(T));
+        T *value = new (memory) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+        {
+            // The cleanup record lives in the arena too.
+            void *slot = allocate(sizeof(cleanup), alignof(cleanup));
+            cleanups_ = new (slot) cleanup{[](void *p)
+                                           { static_cast<T *>(p)->~T(); },
+                                           value, cleanups_};
+        }
+        return value;
+    }
+
+    // Destroys everything made since the last reset and rewinds to the
+    // first block.
+    void reset()
+    {
+        for (cleanup *c = cleanups_; c != nullptr; c = c->next)
+            c->destroy(c->object);
+        cleanups_ = nullptr;
+        current_ = 0;
+        used_ = 0;
+    }
+
+    size_t block_count() const
+    {
+        return blocks_.size();
+    }
+
+private:
+    struct cleanup
+    {
+        void (*destroy)(void *);
+        void *object;
+        cleanup *next;
+    };
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks_;
+    std::vector<size_t> sizes_;
+    size_t current_ = 0;
+    size_t used_ = 0;
+    cleanup *cleanups_ = nullptr;
+
+    void *allocate(size_t size, size_t align)
+    {
+        while (current_ < blocks_.size())
+        {
+            const size_t offset = (used_ + align - 1) & ~(align - 1);
+            if (offset + size <= sizes_[current_])
+            {
+                used_ = offset + size;
+                return blocks_[current_].get() + offset;
+            }
+            ++current_;
+            used_ = 0;
+        }
+
+        // Blocks are new[]'d so their start is aligned for any fundamental
+        // type; an object larger than a block gets a block of its own.
+        const size_t bytes = (std::max)(block_bytes, size);
+        blocks_.push_back(std::make_unique<std::byte[]>(bytes));
+        sizes_.push_back(bytes);
+        current_ = blocks_.size() - 1;
+        used_ = size;
+        return blocks_[current_].get();
+    }
+};
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+
+// Why a packet could not be decoded, or encoded. The recv path and
+// PacketWriter report these instead of throwing, so a malformed packet costs
+// a branch rather than an unwind.
+enum class decode_error : uint8_t
+{
+    none,
+    truncated,
+    unknown_variant,
+    // A value too long for its length prefix.
+    too_long,
+};
+
+inline const char *to_string(decode_error error)
+{
+    switch (error)
+    {
+    case decode_error::none:
+        return "none";
+    case decode_error::truncated:
+        return "truncated";
+    case decode_error::unknown_variant:
+        return "unknown variant";
+    case decode_error::too_long:
+        return "too long";
+    }
+    return "unknown";
+}
+
+// A decoded value or the reason there is none.
+template <typename T>
+class decode_result
+{
+public:
+    decode_result(T value) : value_(std::move(value)), error_(decode_error::none) {}
+
+    decode_result(decode_error error) : value_(), error_(error) {}
+
+    explicit operator bool() const
+    {
+        return error_ == decode_error::none;
+    }
+
+    decode_error error() const
+    {
+        return error_;
+    }
+
+    T &value()
+    {
+        return value_;
+    }
+
+    const T &value() const
+    {
+        return value_;
+    }
+
+    T &operator*()
+    {
+        return value_;
+    }
+
+    const T &operator*() const
+    {
+        return value_;
+    }
+
+    T *operator->()
+    {
+        return &value_;
+    }
+
+    const T *operator->() const
+    {
+        return &value_;
+    }
+
+private:
+    T value_;
+    decode_error error_;
+};
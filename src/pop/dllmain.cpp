@@ -3,9 +3,14 @@
 #include "intercept_manager.h"
 #include "io.h"
 #include "network_communicator.h"
+#include "task_pool.h"
 
-static bool hooksApplied = false;
-static std::thread hookThread;
+static std::atomic<bool> hooksApplied = false;
+
+// Never destroyed. Static destruction runs under the loader lock, where the
+// pool's threads can never exit: on FreeLibrary Shutdown has already stopped
+// them, and at process exit they are already gone.
+task_pool &scheduler = *new task_pool();
 
 void InitializeConsole()
 {
@@ -21,6 +26,20 @@ void InitializeConsole()
 	std::cout.rdbuf(std::cout.rdbuf());
 }
 
+// Call before FreeLibrary, e.g. through CreateRemoteThread on its export.
+// Unhooks, then stops the task pool and joins its threads, which cannot be
+// done from DllMain under the loader lock. Without it the pool's threads
+// would be left running in an unmapped module.
+extern "C" __declspec(dllexport) DWORD WINAPI Shutdown(LPVOID)
+{
+	if (hooksApplied.exchange(false))
+	{
+		intercept_manager::RemoveHook();
+	}
+	scheduler.shutdown();
+	return 0;
+}
+
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
 {
 	switch (ul_reason_for_call)
@@ -30,29 +49,28 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 		InitializeConsole();
 		initialize_shared_memory();
 
-		if (hooksApplied && hookThread.joinable())
-		{
-			hookThread.join();
-		}
-
-		hookThread = std::thread([]()
-								 {
-				intercept_manager::Initialize();
-				intercept_manager::AttachHook();
-				hooksApplied = true; });
+		scheduler.start();
+		scheduler.post([]()
+					   { intercept_manager::Initialize(); },
+					   []()
+					   {
+						   intercept_manager::AttachHook();
+						   hooksApplied = true;
+					   });
 		break;
 
 	case DLL_PROCESS_DETACH:
-		FreeConsole();
-		cleanup_shared_memory();
-		if (hooksApplied && hookThread.joinable())
+		// lpReserved is set when the process is exiting: every other thread
+		// is already gone and there is nothing to unhook or stop. On
+		// FreeLibrary the pool must already have been stopped by Shutdown.
+		if (lpReserved != nullptr)
+			break;
+		if (hooksApplied.exchange(false))
 		{
-			hookThread = std::thread([]()
-									 {
-					intercept_manager::RemoveHook();
-					hooksApplied = false; });
-			hookThread.join();
+			intercept_manager::RemoveHook();
 		}
+		FreeConsole();
+		cleanup_shared_memory();
 		break;
 
 	case DLL_THREAD_ATTACH:
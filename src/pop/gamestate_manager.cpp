@@ -2,6 +2,7 @@
 #include "gamestate_manager.h"
 #include "hostile_players.h"
 #include "spell.h"
+#include "task_pool.h"
 
 game_state_manager game_state;
 
@@ -14,27 +15,19 @@ bool game_state_manager::initialize()
     hostile_players = loadPlayerNames("hostile.txt");
     std::cout << "Hostile Players Loaded [" << hostile_players.size() << "]" << std::endl;
 
-    std::thread gameThread(&game_state_manager::update_game_states, this);
-    gameThread.detach();
+    scheduler.post_every(std::chrono::seconds(1), [this]
+                         { update_game_states(); });
 
     return true;
 }
 
 void game_state_manager::update_game_states()
 {
-    while (true)
-    {
-        auto now = std::chrono::steady_clock::now();
-        deltaTime = std::chrono::duration_cast<std::chrono::duration<double>>(now - lastUpdateTime).count();
-
-        if (deltaTime >= 1.0)
-        {
-            update(deltaTime);
-            lastUpdateTime = now;
-        }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
+    auto now = std::chrono::steady_clock::now();
+    deltaTime = std::chrono::duration_cast<std::chrono::duration<double>>(now - lastUpdateTime).count();
+
+    update(deltaTime);
+    lastUpdateTime = now;
 }
 
 void game_state_manager::update(double deltaTime)
@@ -1,23 +1,127 @@
 #include "pch.h"
+#include "latency_trace.h"
 #include "packet_handler.h"
 #include "packet_registry.h"
+#include "packet_sampler.h"
 #include "packet_structures.h"
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+#include <iterator>
+#include <utility>
 
-std::unordered_map<uint8_t, PacketHandlerFunc> PacketHandlerRegistry::recv_handlers_;
-std::unordered_map<uint8_t, PacketHandlerFunc> PacketHandlerRegistry::send_handlers_;
+namespace
+{
+    // The built-in handlers. Both tables below are built from these lists at
+    // compile time, so dispatch is one indexed load and nothing is registered
+    // at startup.
+    constexpr handler_binding send_bindings[] = {
+        {0x1C, send_handle_packet_x1C, dispatch_order::any},
+        {0x38, send_handle_packet_x38},
+        {0x10, send_handle_packet_x10},
+        {0x0F, send_handle_packet_x0F},
+        {0x13, send_handle_packet_x13, dispatch_order::any},
+        {0x06, send_handle_packet_x06},
+    };
+
+    constexpr handler_binding recv_bindings[] = {
+        {0x3A, recv_handle_packet_x3A},
+        {0x04, recv_handle_packet_x04},
+        {0x0B, recv_handle_packet_x0B},
+        {0x17, recv_handle_packet_x17},
+        {0x0E, recv_handle_packet_x0E, dispatch_order::entity},
+        {0x07, recv_handle_packet_x07, dispatch_order::any},
+        {0x29, recv_handle_packet_x29, dispatch_order::entity},
+        {0x39, recv_handle_packet_x39, dispatch_order::any},
+        {0x18, recv_handle_packet_x18},
+        {0x10, recv_handle_packet_x10},
+        {0x0F, recv_handle_packet_x0F},
+    };
+
+    template <size_t Count>
+    constexpr PacketHandlerFunc bound_handler(const handler_binding (&bindings)[Count], const size_t opcode)
+    {
+        PacketHandlerFunc found = nullptr;
+        for (const auto &binding : bindings)
+        {
+            if (binding.opcode == opcode)
+                found = binding.handler;
+        }
+        return found;
+    }
+
+    // Atomics cannot be copied, so the table is built element by element
+    // rather than filled in a loop and returned.
+    template <size_t Count, size_t... Opcode>
+    constexpr std::array<std::atomic<PacketHandlerFunc>, 256> handler_table(
+        const handler_binding (&bindings)[Count],
+        std::index_sequence<Opcode...>)
+    {
+        return {std::atomic<PacketHandlerFunc>(bound_handler(bindings, Opcode))...};
+    }
+
+    template <size_t Count>
+    constexpr dispatch_order bound_order(const handler_binding (&bindings)[Count], const size_t opcode)
+    {
+        dispatch_order found = dispatch_order::total;
+        for (const auto &binding : bindings)
+        {
+            if (binding.opcode == opcode)
+                found = binding.order;
+        }
+        return found;
+    }
+
+    template <size_t Count, size_t... Opcode>
+    constexpr std::array<opcode_policy, 256> policy_table(
+        const handler_binding (&bindings)[Count],
+        std::index_sequence<Opcode...>)
+    {
+        return {opcode_policy{bound_order(bindings, Opcode)}...};
+    }
+}
+
+constinit std::array<std::atomic<PacketHandlerFunc>, 256> PacketHandlerRegistry::recv_handlers_ =
+    handler_table(recv_bindings, std::make_index_sequence<256>{});
+constinit std::array<std::atomic<PacketHandlerFunc>, 256> PacketHandlerRegistry::send_handlers_ =
+    handler_table(send_bindings, std::make_index_sequence<256>{});
+constinit std::array<std::atomic<const handler_chain *>, 256> PacketHandlerRegistry::recv_chains_{};
+constinit std::array<std::atomic<const handler_chain *>, 256> PacketHandlerRegistry::send_chains_{};
+std::mutex PacketHandlerRegistry::chains_mutex_;
+std::vector<PacketHandlerRegistry::retired_chain> PacketHandlerRegistry::retired_chains_;
+subscription_id PacketHandlerRegistry::next_subscription_ = 1;
+std::array<decoded_route, 256> PacketHandlerRegistry::recv_routes_;
+std::array<decoded_route, 256> PacketHandlerRegistry::send_routes_;
+constinit std::array<opcode_policy, 256> PacketHandlerRegistry::recv_policy_ = policy_table(recv_bindings, std::make_index_sequence<256>{});
+constinit std::array<opcode_policy, 256> PacketHandlerRegistry::send_policy_ = policy_table(send_bindings, std::make_index_sequence<256>{});
+std::array<PacketHandlerRegistry::opcode_counters, 256> PacketHandlerRegistry::send_counters_;
+std::array<PacketHandlerRegistry::opcode_counters, 256> PacketHandlerRegistry::recv_counters_;
+std::mutex PacketHandlerRegistry::stalls_mutex_;
+std::array<handler_stall, PacketHandlerRegistry::stall_history> PacketHandlerRegistry::stalls_{};
+size_t PacketHandlerRegistry::stall_count_ = 0;
+std::mutex PacketHandlerRegistry::in_flight_mutex_;
+std::vector<std::shared_ptr<PacketHandlerRegistry::in_flight>> PacketHandlerRegistry::in_flight_;
+std::array<std::atomic<uint32_t>, 256> PacketHandlerRegistry::malformed_send_{};
+std::array<std::atomic<uint32_t>, 256> PacketHandlerRegistry::malformed_recv_{};
 
 void PacketHandlerRegistry::register_send_handlers(
     const uint8_t opcode,
-    const PacketHandlerFunc handler)
+    const PacketHandlerFunc handler,
+    const std::optional<dispatch_order> order)
 {
-    send_handlers_[opcode] = handler;
+    send_handlers_[opcode].store(handler, std::memory_order_release);
+    if (order)
+        send_policy_[opcode].order.store(*order, std::memory_order_relaxed);
 }
 
 void PacketHandlerRegistry::register_recv_handlers(
     const uint8_t opcode,
-    const PacketHandlerFunc handler)
+    const PacketHandlerFunc handler,
+    const std::optional<dispatch_order> order)
 {
-    recv_handlers_[opcode] = handler;
+    recv_handlers_[opcode].store(handler, std::memory_order_release);
+    if (order)
+        recv_policy_[opcode].order.store(*order, std::memory_order_relaxed);
 }
 
 void PacketHandlerRegistry::handle_outgoing_data(const packet &pkt)
@@ -26,10 +130,21 @@ void PacketHandlerRegistry::handle_outgoing_data(const packet &pkt)
     if (pkt.length < 2)
         return;
 
-    if (const auto it = send_handlers_.find(pkt.data[0]); it != send_handlers_.end())
-    {
-        it->second(pkt);
-    }
+    run_timed(packet_direction::send, pkt, [&pkt]()
+              {
+        const auto handler = send_handlers_[pkt.data[0]].load(std::memory_order_acquire);
+        if (handler != nullptr)
+        {
+            if (const auto error = handler(pkt); error != decode_error::none)
+                record_malformed(malformed_send_, pkt, error);
+        }
+        else if (send_chains_[pkt.data[0]].load(std::memory_order_relaxed) == nullptr && send_routes_[pkt.data[0]].subscribers.empty())
+        {
+            unhandled_packets.sample(packet_direction::send, pkt);
+        }
+
+        run_chain(send_chains_[pkt.data[0]], pkt);
+        publish(send_routes_[pkt.data[0]], malformed_send_, counters(packet_direction::send, pkt.data[0]), pkt); });
 }
 
 void PacketHandlerRegistry::handle_incoming_data(const packet &pkt)
@@ -38,8 +153,392 @@ void PacketHandlerRegistry::handle_incoming_data(const packet &pkt)
     if (pkt.length < 2)
         return;
 
-    if (const auto it = recv_handlers_.find(pkt.data[0]); it != recv_handlers_.end())
+    run_timed(packet_direction::recv, pkt, [&pkt]()
+              {
+        const auto handler = recv_handlers_[pkt.data[0]].load(std::memory_order_acquire);
+        if (handler != nullptr)
+        {
+            if (const auto error = handler(pkt); error != decode_error::none)
+                record_malformed(malformed_recv_, pkt, error);
+        }
+        else if (recv_chains_[pkt.data[0]].load(std::memory_order_relaxed) == nullptr && recv_routes_[pkt.data[0]].subscribers.empty())
+        {
+            unhandled_packets.sample(packet_direction::recv, pkt);
+        }
+
+        run_chain(recv_chains_[pkt.data[0]], pkt);
+        publish(recv_routes_[pkt.data[0]], malformed_recv_, counters(packet_direction::recv, pkt.data[0]), pkt); });
+}
+
+subscription_id PacketHandlerRegistry::subscribe_chain(
+    const packet_direction direction,
+    const uint8_t opcode,
+    const int priority,
+    chain_subscriber subscriber)
+{
+    auto &slot = (direction == packet_direction::send ? send_chains_ : recv_chains_)[opcode];
+
+    std::lock_guard<std::mutex> lock(chains_mutex_);
+    const subscription_id id = next_subscription_++;
+
+    auto *chain = new handler_chain();
+    if (const auto *current = slot.load(std::memory_order_relaxed))
+        chain->links = current->links;
+    const auto after = std::find_if(chain->links.begin(), chain->links.end(), [priority](const handler_chain::link &link)
+                                    { return link.priority < priority; });
+    chain->links.insert(after, handler_chain::link{priority, id, std::move(subscriber)});
+
+    replace_chain(slot, chain);
+    return id;
+}
+
+void PacketHandlerRegistry::unsubscribe_chain(const subscription_id id)
+{
+    std::lock_guard<std::mutex> lock(chains_mutex_);
+    for (auto *chains : {&send_chains_, &recv_chains_})
+    {
+        for (auto &slot : *chains)
+        {
+            const auto *current = slot.load(std::memory_order_relaxed);
+            if (current == nullptr)
+                continue;
+
+            const auto match = [id](const handler_chain::link &link)
+            {
+                return link.id == id;
+            };
+            if (std::none_of(current->links.begin(), current->links.end(), match))
+                continue;
+
+            handler_chain *chain = nullptr;
+            if (current->links.size() > 1)
+            {
+                chain = new handler_chain();
+                std::remove_copy_if(current->links.begin(), current->links.end(), std::back_inserter(chain->links), match);
+            }
+            replace_chain(slot, chain);
+            return;
+        }
+    }
+}
+
+// Called with chains_mutex_ held.
+void PacketHandlerRegistry::replace_chain(std::atomic<const handler_chain *> &slot, const handler_chain *chain)
+{
+    const handler_chain *previous = slot.exchange(chain, std::memory_order_seq_cst);
+    if (previous != nullptr)
+        retired_chains_.push_back(retired_chain{previous, std::chrono::steady_clock::now().time_since_epoch().count()});
+    reclaim_chains();
+}
+
+// Called with chains_mutex_ held. A dispatch thread marks itself in flight
+// before it loads a chain, so one that could still be walking a retired chain
+// is in flight with a start time no later than the retirement.
+void PacketHandlerRegistry::reclaim_chains()
+{
+    if (retired_chains_.empty())
+        return;
+
+    int64_t oldestReader = INT64_MAX;
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        for (const auto &slot : in_flight_)
+        {
+            const int64_t started = slot->startedTicks.load(std::memory_order_seq_cst);
+            if (started != 0)
+                oldestReader = (std::min)(oldestReader, started);
+        }
+    }
+
+    std::erase_if(retired_chains_, [oldestReader](const retired_chain &retired)
+                  {
+        if (retired.retiredTicks >= oldestReader)
+            return false;
+        delete retired.chain;
+        return true; });
+}
+
+void PacketHandlerRegistry::run_chain(const std::atomic<const handler_chain *> &slot, const packet &pkt)
+{
+    const handler_chain *chain = slot.load(std::memory_order_seq_cst);
+    if (chain == nullptr)
+        return;
+
+    for (const auto &link : chain->links)
+    {
+        if (link.subscriber(pkt) == chain_result::stop)
+            break;
+    }
+}
+
+void PacketHandlerRegistry::publish(
+    decoded_route &route,
+    std::array<std::atomic<uint32_t>, 256> &malformed,
+    opcode_counters &stats,
+    const packet &pkt)
+{
+    if (route.subscribers.empty())
+        return;
+
+    decode_error error = decode_error::none;
+    const auto started = std::chrono::steady_clock::now();
+    const void *value = route.decode(pkt, arena(), error);
+    stats.routeDecodeNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count(),
+                             std::memory_order_relaxed);
+    if (error != decode_error::none)
+    {
+        record_malformed(malformed, pkt, error);
+        return;
+    }
+
+    for (const auto &subscriber : route.subscribers)
+        subscriber(value);
+}
+
+decode_arena &PacketHandlerRegistry::arena()
+{
+    thread_local decode_arena lane_arena;
+    return lane_arena;
+}
+
+void PacketHandlerRegistry::retire_batch()
+{
+    arena().reset();
+}
+
+PacketHandlerRegistry::in_flight &PacketHandlerRegistry::in_flight_slot()
+{
+    thread_local const std::shared_ptr<in_flight> slot = []
+    {
+        auto created = std::make_shared<in_flight>();
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        in_flight_.push_back(created);
+        return created;
+    }();
+    return *slot;
+}
+
+void PacketHandlerRegistry::note_backlog(const size_t backlog)
+{
+    in_flight_slot().backlog.store(backlog, std::memory_order_relaxed);
+}
+
+template <typename Handle>
+void PacketHandlerRegistry::run_timed(const packet_direction direction, const packet &pkt, Handle &&handle)
+{
+    auto &slot = in_flight_slot();
+    const auto started = std::chrono::steady_clock::now();
+    slot.what.store(static_cast<uint16_t>(static_cast<uint16_t>(direction) << 8 | pkt.data[0]), std::memory_order_relaxed);
+    // Sequentially consistent so reclaim_chains sees this before the chain
+    // load that follows it.
+    slot.startedTicks.store(started.time_since_epoch().count(), std::memory_order_seq_cst);
+
+    const auto captured = pkt.captured_at();
+    const bool traced = captured.time_since_epoch().count() != 0 && captured <= started;
+    {
+        // Whatever the handler sends, now or from work it posts, is a
+        // reaction to this packet.
+        latency_trace::cause_scope cause(traced ? reaction_cause{direction, pkt.data[0], captured.time_since_epoch().count()} : reaction_cause{});
+        handle();
+    }
+
+    const auto finished = std::chrono::steady_clock::now();
+    slot.startedTicks.store(0, std::memory_order_release);
+
+    auto &stats = counters(direction, pkt.data[0]);
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(finished - started);
+    stats.packets.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes.fetch_add(pkt.length, std::memory_order_relaxed);
+    stats.handlerNs.fetch_add(ns.count(), std::memory_order_relaxed);
+    const auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(ns).count());
+    stats.histogram[(std::min)(static_cast<size_t>(std::bit_width(us)), opcode_stats::histogram_buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+
+    // Packets that never went through the hook, such as ones we inject,
+    // carry no capture time.
+    if (traced)
+    {
+        latency_trace::record_dispatch(direction, pkt.data[0], captured, started, finished);
+
+        const auto waited = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(started - captured).count());
+        stats.waitUs.fetch_add(waited, std::memory_order_relaxed);
+        uint64_t worst = stats.maxWaitUs.load(std::memory_order_relaxed);
+        while (worst < waited && !stats.maxWaitUs.compare_exchange_weak(worst, waited, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(ns);
+    if (elapsed > policy_of(direction, pkt.data[0]).budget)
+        record_overrun(direction, pkt, elapsed, slot.backlog.load(std::memory_order_relaxed));
+}
+
+void PacketHandlerRegistry::record_overrun(
+    const packet_direction direction,
+    const packet &pkt,
+    const std::chrono::microseconds elapsed,
+    const size_t backlog)
+{
+    auto &timing = counters(direction, pkt.data[0]);
+    const auto us = static_cast<uint32_t>((std::min)(elapsed.count(), std::chrono::microseconds::rep{UINT32_MAX}));
+    const bool first = timing.overruns.fetch_add(1, std::memory_order_relaxed) == 0;
+
+    uint32_t previous = timing.worstUs.load(std::memory_order_relaxed);
+    while (previous < us && !timing.worstUs.compare_exchange_weak(previous, us, std::memory_order_relaxed))
+    {
+    }
+    const bool muchWorse = us >= 2ull * previous;
+
+    {
+        std::lock_guard<std::mutex> lock(stalls_mutex_);
+        stalls_[stall_count_++ % stall_history] = handler_stall{direction, pkt.data[0], elapsed, backlog, pkt.sequence()};
+    }
+
+    // The first overrun, and any that at least doubles the worst so far, is
+    // logged; the rest are counted.
+    if (first || muchWorse)
+    {
+        std::cout << "Slow handler " << (direction == packet_direction::send ? "send" : "recv") << " 0x"
+                  << std::hex << std::uppercase << static_cast<int>(pkt.data[0]) << std::dec << ": "
+                  << elapsed.count() << "us, " << backlog << " packets waiting behind it" << std::endl;
+    }
+}
+
+void PacketHandlerRegistry::check_in_flight()
+{
+    // Chains retired while nothing is subscribing would otherwise wait for
+    // the next registration to be freed.
+    {
+        std::lock_guard<std::mutex> lock(chains_mutex_);
+        reclaim_chains();
+    }
+
+    const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    for (const auto &slot : in_flight_)
+    {
+        const int64_t started = slot->startedTicks.load(std::memory_order_acquire);
+        if (started == 0 || started == slot->reportedTicks)
+            continue;
+
+        const uint16_t what = slot->what.load(std::memory_order_relaxed);
+        const auto direction = static_cast<packet_direction>(what >> 8);
+        const auto opcode = static_cast<uint8_t>(what & 0xFF);
+        const auto running = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::duration(now - started));
+        if (running <= policy_of(direction, opcode).budget * stall_factor)
+            continue;
+
+        slot->reportedTicks = started;
+        std::cout << "Handler " << (direction == packet_direction::send ? "send" : "recv") << " 0x"
+                  << std::hex << std::uppercase << static_cast<int>(opcode) << std::dec
+                  << " is blocking its dispatch lane: running " << running.count() << "us, "
+                  << slot->backlog.load(std::memory_order_relaxed) << " packets waiting" << std::endl;
+    }
+}
+
+opcode_stats PacketHandlerRegistry::stats_of(const packet_direction direction, const uint8_t opcode)
+{
+    const auto &c = counters(direction, opcode);
+    opcode_stats stats;
+    stats.packets = c.packets.load(std::memory_order_relaxed);
+    stats.bytes = c.bytes.load(std::memory_order_relaxed);
+    stats.malformed = direction == packet_direction::send ? malformed_send_count(opcode) : malformed_recv_count(opcode);
+    stats.handler_time = std::chrono::nanoseconds(c.handlerNs.load(std::memory_order_relaxed));
+    stats.route_decode_time = std::chrono::nanoseconds(c.routeDecodeNs.load(std::memory_order_relaxed));
+    stats.queue_wait = std::chrono::microseconds(c.waitUs.load(std::memory_order_relaxed));
+    stats.max_queue_wait = std::chrono::microseconds(c.maxWaitUs.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < stats.handler_histogram.size(); ++i)
+        stats.handler_histogram[i] = c.histogram[i].load(std::memory_order_relaxed);
+    return stats;
+}
+
+void PacketHandlerRegistry::dump_stats(std::ostream &out, const size_t limit)
+{
+    struct row
+    {
+        packet_direction direction;
+        uint8_t opcode;
+        opcode_stats stats;
+    };
+
+    std::vector<row> rows;
+    for (const auto direction : {packet_direction::send, packet_direction::recv})
+    {
+        for (size_t opcode = 0; opcode < 256; ++opcode)
+        {
+            if (auto stats = stats_of(direction, static_cast<uint8_t>(opcode)); stats.packets != 0)
+                rows.push_back(row{direction, static_cast<uint8_t>(opcode), stats});
+        }
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const row &a, const row &b)
+              { return a.stats.handler_time > b.stats.handler_time; });
+    if (rows.size() > limit)
+        rows.resize(limit);
+
+    // op  count  bytes  handler total/mean  typed-route decode total  wait mean/max  bad
+    out << "Packet stats (by handler time):\n";
+    for (const auto &r : rows)
+    {
+        const auto &st = r.stats;
+        out << (r.direction == packet_direction::send ? "-> " : "<- ")
+            << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << static_cast<int>(r.opcode)
+            << std::dec << std::setfill(' ')
+            << " n=" << st.packets
+            << " bytes=" << st.bytes
+            << " handler=" << std::chrono::duration_cast<std::chrono::microseconds>(st.handler_time).count() << "us"
+            << " mean=" << st.mean_handler_time().count() << "ns"
+            << " route_decode=" << std::chrono::duration_cast<std::chrono::microseconds>(st.route_decode_time).count() << "us"
+            << " wait=" << st.mean_queue_wait().count() << "/" << st.max_queue_wait.count() << "us";
+        if (st.malformed != 0)
+            out << " malformed=" << st.malformed;
+        out << '\n';
+    }
+    out.flush();
+}
+
+uint32_t PacketHandlerRegistry::overrun_count(const packet_direction direction, const uint8_t opcode)
+{
+    return counters(direction, opcode).overruns.load(std::memory_order_relaxed);
+}
+
+std::chrono::microseconds PacketHandlerRegistry::worst_handler_time(const packet_direction direction, const uint8_t opcode)
+{
+    return std::chrono::microseconds(counters(direction, opcode).worstUs.load(std::memory_order_relaxed));
+}
+
+std::vector<handler_stall> PacketHandlerRegistry::recent_stalls()
+{
+    std::lock_guard<std::mutex> lock(stalls_mutex_);
+    std::vector<handler_stall> recent;
+    const size_t count = (std::min)(stall_count_, stall_history);
+    recent.reserve(count);
+    for (size_t i = stall_count_ - count; i < stall_count_; ++i)
+        recent.push_back(stalls_[i % stall_history]);
+    return recent;
+}
+
+uint32_t PacketHandlerRegistry::malformed_send_count(const uint8_t opcode)
+{
+    return malformed_send_[opcode].load(std::memory_order_relaxed);
+}
+
+uint32_t PacketHandlerRegistry::malformed_recv_count(const uint8_t opcode)
+{
+    return malformed_recv_[opcode].load(std::memory_order_relaxed);
+}
+
+void PacketHandlerRegistry::record_malformed(
+    std::array<std::atomic<uint32_t>, 256> &counters,
+    const packet &pkt,
+    const decode_error error)
+{
+    // Only the first failure per opcode is logged so a flood of bad packets
+    // cannot turn into a flood of console output.
+    if (counters[pkt.data[0]].fetch_add(1, std::memory_order_relaxed) == 0)
     {
-        it->second(pkt);
+        std::cout << "Malformed packet 0x" << std::hex << std::uppercase << static_cast<int>(pkt.data[0])
+                  << std::dec << " (" << pkt.length << " bytes): " << to_string(error) << std::endl;
     }
 }
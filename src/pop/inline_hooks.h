@@ -0,0 +1,312 @@
+#pragma once
+#include "pch.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include "packet_trace.h"
+#include "packet_view.h"
+
+enum class hook_verdict : uint8_t
+{
+    pass,
+    // The packet goes no further: neither the game nor our own handlers see
+    // it. A dropped send never reaches the server. A dropped recv never
+    // reaches the game's packet handler, so the client behaves as if the
+    // server had not sent it; the stub returns 0 in place of the handler's
+    // result and the connection's byte stream is untouched, since the hook
+    // sits after the client has framed the packet.
+    drop,
+    rewrite,
+};
+
+// The packet as the game handed it to the stub: its own buffer, not a copy.
+// A hook that returns rewrite has edited the bytes in place; it may shorten
+// length but never grow it past capacity.
+struct inline_packet
+{
+    BYTE *data;
+    int length;
+    const int capacity;
+
+    BYTE opcode() const
+    {
+        return data[0];
+    }
+
+    PacketView view() const
+    {
+        return PacketView(data, static_cast<size_t>(length));
+    }
+};
+
+using inline_hook = hook_verdict (*)(inline_packet &pkt);
+
+// Time spent in the inline stage, per direction. Only packets whose opcode
+// has a hook are counted; every other packet pays one relaxed load.
+struct inline_stage_stats
+{
+    // Upper bounds of the histogram buckets; the last bucket is >= 1us.
+    static constexpr std::array<uint32_t, 4> bucket_ns = {100, 250, 500, 1000};
+
+    uint64_t calls = 0;
+    uint64_t dropped = 0;
+    uint64_t rewritten = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t evicted = 0;
+    std::array<uint64_t, bucket_ns.size() + 1> histogram{};
+
+    uint64_t mean_ns() const
+    {
+        return calls != 0 ? total_ns / calls : 0;
+    }
+};
+
+// Filters that run inside SendFunctionStub/RecvFunctionStub, on the game's
+// own thread, before the packet is forwarded. This is the only place a
+// packet can be vetoed or rewritten, and the only place that runs inside the
+// game's network path, so hooks are held to a hard rule: a plain function,
+// no allocation, no locks, no I/O, done within its budget.
+//
+// Each hook is timed. One that overruns its budget evict_after times in a
+// row is unhooked rather than left to stall the client; the eviction is only noted
+// in its slot, and report_evictions prints it later from a worker.
+// Registration takes a lock; running hooks does not.
+class inline_hooks
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t hooks_per_opcode = 4;
+    static constexpr std::chrono::nanoseconds default_budget{500};
+    static constexpr uint32_t evict_after = 8;
+
+    // False when the opcode already has hooks_per_opcode hooks.
+    static bool add(packet_direction direction, BYTE opcode, inline_hook hook,
+                    std::chrono::nanoseconds budget = default_budget)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &table = tables_[index(direction)];
+        for (auto &s : table.slots[opcode])
+        {
+            if (s.fn.load(std::memory_order_relaxed) != nullptr)
+                continue;
+            s.budget_ns = static_cast<uint64_t>(budget.count());
+            s.overruns.store(0, std::memory_order_relaxed);
+            s.evicted_ns.store(0, std::memory_order_relaxed);
+            s.fn.store(hook, std::memory_order_release);
+            table.armed[opcode].fetch_add(1, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+    static void remove(packet_direction direction, BYTE opcode, inline_hook hook)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &table = tables_[index(direction)];
+        for (auto &s : table.slots[opcode])
+        {
+            inline_hook expected = hook;
+            if (s.fn.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+                table.armed[opcode].fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Runs the opcode's hooks in registration order. The first drop wins;
+    // any rewrite makes the verdict rewrite and length is updated to the
+    // rewritten size.
+    static hook_verdict run(packet_direction direction, BYTE *data, int &length)
+    {
+        auto &table = tables_[index(direction)];
+        const BYTE opcode = data[0];
+        if (table.armed[opcode].load(std::memory_order_relaxed) == 0)
+            return hook_verdict::pass;
+
+        const auto start = clock::now();
+        auto mark = start;
+        inline_packet pkt{data, length, length};
+        hook_verdict verdict = hook_verdict::pass;
+
+        for (auto &s : table.slots[opcode])
+        {
+            const inline_hook hook = s.fn.load(std::memory_order_acquire);
+            if (hook == nullptr)
+                continue;
+
+            const hook_verdict result = hook(pkt);
+            const auto now = clock::now();
+            charge(direction, opcode, s, now - mark);
+            mark = now;
+
+            if (result == hook_verdict::drop)
+            {
+                verdict = hook_verdict::drop;
+                break;
+            }
+            if (result == hook_verdict::rewrite)
+                verdict = hook_verdict::rewrite;
+        }
+
+        if (verdict == hook_verdict::rewrite)
+            length = (std::clamp)(pkt.length, 1, pkt.capacity);
+
+        record(table.stats, mark - start, verdict);
+        return verdict;
+    }
+
+    static inline_stage_stats stats(packet_direction direction)
+    {
+        const auto &s = tables_[index(direction)].stats;
+        inline_stage_stats out;
+        out.calls = s.calls.load(std::memory_order_relaxed);
+        out.dropped = s.dropped.load(std::memory_order_relaxed);
+        out.rewritten = s.rewritten.load(std::memory_order_relaxed);
+        out.total_ns = s.total_ns.load(std::memory_order_relaxed);
+        out.max_ns = s.max_ns.load(std::memory_order_relaxed);
+        out.evicted = s.evicted.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < out.histogram.size(); ++i)
+            out.histogram[i] = s.histogram[i].load(std::memory_order_relaxed);
+        return out;
+    }
+
+    // The stage's cost per direction that has run a hook, then any hook
+    // evicted since the last call.
+    static void dump(std::ostream &out)
+    {
+        for (const auto direction : {packet_direction::send, packet_direction::recv})
+        {
+            const auto s = stats(direction);
+            if (s.calls == 0)
+                continue;
+
+            out << "Inline stage " << (direction == packet_direction::send ? "send" : "recv")
+                << ": n=" << s.calls << " dropped=" << s.dropped << " rewritten=" << s.rewritten
+                << " mean=" << s.mean_ns() << "ns max=" << s.max_ns << "ns evicted=" << s.evicted;
+            for (size_t i = 0; i < s.histogram.size(); ++i)
+            {
+                if (i < inline_stage_stats::bucket_ns.size())
+                    out << " <" << inline_stage_stats::bucket_ns[i] << "ns:";
+                else
+                    out << " >=" << inline_stage_stats::bucket_ns.back() << "ns:";
+                out << s.histogram[i];
+            }
+            out << '\n';
+        }
+        report_evictions(out);
+        out.flush();
+    }
+
+    // Prints each hook evicted since the last call. Returns how many.
+    static size_t report_evictions(std::ostream &out)
+    {
+        size_t reported = 0;
+        for (size_t d = 0; d < tables_.size(); ++d)
+        {
+            for (size_t opcode = 0; opcode < 256; ++opcode)
+            {
+                for (auto &s : tables_[d].slots[opcode])
+                {
+                    const uint64_t ns = s.evicted_ns.exchange(0, std::memory_order_relaxed);
+                    if (ns == 0)
+                        continue;
+                    out << "Inline hook for " << (d == index(packet_direction::send) ? "send" : "recv")
+                        << " opcode 0x" << std::hex << opcode << std::dec
+                        << " evicted: took " << ns << "ns against a " << s.budget_ns << "ns budget\n";
+                    ++reported;
+                }
+            }
+        }
+        if (reported != 0)
+            out.flush();
+        return reported;
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<inline_hook> fn{nullptr};
+        uint64_t budget_ns = 0;
+        std::atomic<uint32_t> overruns{0};
+        // The overrun that evicted the hook, until it has been reported.
+        std::atomic<uint64_t> evicted_ns{0};
+    };
+
+    struct counters
+    {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> rewritten{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::atomic<uint64_t> evicted{0};
+        std::array<std::atomic<uint64_t>, inline_stage_stats::bucket_ns.size() + 1> histogram{};
+    };
+
+    struct table
+    {
+        std::array<std::atomic<uint8_t>, 256> armed{};
+        std::array<std::array<slot, hooks_per_opcode>, 256> slots;
+        counters stats;
+    };
+
+    static std::array<table, 2> tables_;
+    static std::mutex mutex_;
+
+    static size_t index(packet_direction direction)
+    {
+        return static_cast<size_t>(direction);
+    }
+
+    static void charge(packet_direction direction, BYTE opcode, slot &s, clock::duration elapsed)
+    {
+        const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        if (ns <= s.budget_ns)
+        {
+            // Only overruns in a row count: a hook the scheduler preempted
+            // now and then is not a slow hook.
+            if (s.overruns.load(std::memory_order_relaxed) != 0)
+                s.overruns.store(0, std::memory_order_relaxed);
+            return;
+        }
+        if (s.overruns.fetch_add(1, std::memory_order_relaxed) + 1 < evict_after)
+            return;
+
+        inline_hook hook = s.fn.load(std::memory_order_relaxed);
+        if (hook == nullptr || !s.fn.compare_exchange_strong(hook, nullptr, std::memory_order_acq_rel))
+            return;
+
+        auto &t = tables_[index(direction)];
+        t.armed[opcode].fetch_sub(1, std::memory_order_relaxed);
+        t.stats.evicted.fetch_add(1, std::memory_order_relaxed);
+        s.evicted_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    static void record(counters &c, clock::duration elapsed, hook_verdict verdict)
+    {
+        const auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        c.calls.fetch_add(1, std::memory_order_relaxed);
+        c.total_ns.fetch_add(ns, std::memory_order_relaxed);
+        if (verdict == hook_verdict::drop)
+            c.dropped.fetch_add(1, std::memory_order_relaxed);
+        else if (verdict == hook_verdict::rewrite)
+            c.rewritten.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t worst = c.max_ns.load(std::memory_order_relaxed);
+        while (ns > worst && !c.max_ns.compare_exchange_weak(worst, ns, std::memory_order_relaxed))
+        {
+        }
+
+        size_t bucket = 0;
+        while (bucket < inline_stage_stats::bucket_ns.size() && ns >= inline_stage_stats::bucket_ns[bucket])
+            ++bucket;
+        c.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+inline std::array<inline_hooks::table, 2> inline_hooks::tables_{};
+inline std::mutex inline_hooks::mutex_;
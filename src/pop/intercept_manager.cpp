@@ -1,11 +1,15 @@
 #include "pch.h"
 #include "intercept_manager.h"
 #include <future>
-#include "packet_reader.h"
 #include "gamestate_manager.h"
+#include "inline_hooks.h"
+#include "latency_trace.h"
 #include "overlay_manager.h"
+#include "packet_layouts.h"
 #include "packet_processor.h"
 #include "packet_registry.h"
+#include "packet_sampler.h"
+#include "task_pool.h"
 
 intercept_manager::PFN_ORIGINAL_SEND
 	intercept_manager::TrueSendFunction = nullptr;
@@ -26,7 +30,9 @@ int __stdcall intercept_manager::SendFunctionStub(BYTE *data, int arg1, int arg2
 {
 	if (data == nullptr || arg1 < 2)
 		return 0;
-	packetProcessor.enqueueSend(std::make_shared<packet>(data, arg1));
+	if (inline_hooks::run(packet_direction::send, data, arg1) == hook_verdict::drop)
+		return 0;
+	packetProcessor.enqueueSend(packet(data, arg1));
 	return TrueSendFunction(data, arg1, arg2, arg3);
 }
 
@@ -34,7 +40,10 @@ int __stdcall intercept_manager::RecvFunctionStub(BYTE *data, int arg1)
 {
 	if (data == nullptr || arg1 < 2)
 		return 0;
-	packetProcessor.enqueueRecv(std::make_shared<packet>(data, arg1));
+	// A dropped packet never reaches the game's handler; see hook_verdict::drop.
+	if (inline_hooks::run(packet_direction::recv, data, arg1) == hook_verdict::drop)
+		return 0;
+	packetProcessor.enqueueRecv(packet(data, arg1));
 	return TrueRecvFunction(data, arg1);
 }
 
@@ -42,7 +51,7 @@ void __stdcall intercept_manager::on_packet_send(packet *packet)
 {
 	if (packet != nullptr && packet->length >= 2)
 	{
-		packet->print_hex();
+		packet_trace::trace(packet_direction::send, packet->data, packet->length);
 		PacketHandlerRegistry::handle_outgoing_data(*packet);
 	}
 }
@@ -66,36 +75,53 @@ void intercept_manager::initialize_game_state()
 
 void intercept_manager::initialize_drawing_manager()
 {
-	std::thread overlayThread([&]()
+	scheduler.start_ui([]()
 		{
 			drawing_manager.initialize();
 			drawing_manager.run();
 		});
-	overlayThread.detach();
 }
 
 void intercept_manager::initialize_handlers()
 {
-	PacketHandlerRegistry::register_send_handlers(0x1C, send_handle_packet_x1C);
-	PacketHandlerRegistry::register_send_handlers(0x38, send_handle_packet_x38);
-	PacketHandlerRegistry::register_send_handlers(0x10, send_handle_packet_x10);
-	PacketHandlerRegistry::register_send_handlers(0x0F, send_handle_packet_x0F);
-	PacketHandlerRegistry::register_send_handlers(0x13, send_handle_packet_x13);
-	PacketHandlerRegistry::register_send_handlers(0x06, send_handle_packet_x06);
-
-	PacketHandlerRegistry::register_recv_handlers(0x3A, recv_handle_packet_x3A);
-	PacketHandlerRegistry::register_recv_handlers(0x04, recv_handle_packet_x04);
-	PacketHandlerRegistry::register_recv_handlers(0x0B, recv_handle_packet_x0B);
-	PacketHandlerRegistry::register_recv_handlers(0x0C, recv_handle_packet_x0C);
-	PacketHandlerRegistry::register_recv_handlers(0x17, recv_handle_packet_x17);
-	PacketHandlerRegistry::register_recv_handlers(0x0E, recv_handle_packet_x0E);
-	PacketHandlerRegistry::register_recv_handlers(0x07, recv_handle_packet_x07);
-	PacketHandlerRegistry::register_recv_handlers(0x33, recv_handle_packet_x33);
-	PacketHandlerRegistry::register_recv_handlers(0x29, recv_handle_packet_x29);
-	PacketHandlerRegistry::register_recv_handlers(0x39, recv_handle_packet_x39);
-	PacketHandlerRegistry::register_recv_handlers(0x18, recv_handle_packet_x18);
-	PacketHandlerRegistry::register_recv_handlers(0x10, recv_handle_packet_x10);
-	PacketHandlerRegistry::register_recv_handlers(0x0F, recv_handle_packet_x0F);
+	packet_trace::enable_all(packet_direction::send, true);
+
+	PacketHandlerRegistry::subscribe_recv<layouts::entity_walk>(recv_on_entity_walk);
+	PacketHandlerRegistry::set_dispatch_order(packet_direction::recv, 0x0C, dispatch_order::entity);
+	PacketHandlerRegistry::subscribe_recv<layouts::player_appearance>(recv_on_player_appearance);
+	PacketHandlerRegistry::set_dispatch_order(packet_direction::recv, 0x33, dispatch_order::entity);
+
+	PacketHandlerRegistry::set_serial_offset(packet_direction::recv, 0x0C, 1, recv_is_self_x0C);
+	PacketHandlerRegistry::set_serial_offset(packet_direction::recv, 0x33, 6, recv_is_self_x33);
+	PacketHandlerRegistry::set_serial_offset(packet_direction::recv, 0x0E, 1);
+	PacketHandlerRegistry::set_serial_offset(packet_direction::recv, 0x29, 1);
+
+	// Priorities only reorder the shard and parallel lanes; the ordered lane
+	// (x3A and the other self-state opcodes) keeps arrival order. On a shard,
+	// combat x29/x0C overtake the x33/x0E of a map load; on the parallel lane,
+	// x07/x39 dumps yield to the x1C/x13 sends queued with them.
+	PacketHandlerRegistry::set_priority(packet_direction::recv, 0x29, packet_priority::combat);
+	PacketHandlerRegistry::set_priority(packet_direction::recv, 0x0C, packet_priority::combat);
+	PacketHandlerRegistry::set_priority(packet_direction::recv, 0x07, packet_priority::bulk);
+	PacketHandlerRegistry::set_priority(packet_direction::recv, 0x39, packet_priority::bulk);
+
+	PacketHandlerRegistry::set_overload_policy(packet_direction::recv, 0x0C, overload_policy::coalesce);
+	PacketHandlerRegistry::set_overload_policy(packet_direction::recv, 0x33, overload_policy::coalesce);
+	for (const uint8_t opcode : {0x0E, 0x17, 0x18, 0x0F, 0x10})
+		PacketHandlerRegistry::set_overload_policy(packet_direction::recv, opcode, overload_policy::never_drop);
+
+	// Map loads and legends are big enough to need more than the default.
+	PacketHandlerRegistry::set_budget(packet_direction::recv, 0x07, std::chrono::milliseconds(10));
+	PacketHandlerRegistry::set_budget(packet_direction::recv, 0x39, std::chrono::milliseconds(10));
+	scheduler.watch_every(std::chrono::milliseconds(100), PacketHandlerRegistry::check_in_flight);
+	scheduler.post_every(std::chrono::minutes(1), []()
+		{
+			PacketHandlerRegistry::dump_stats(std::cout);
+			packetProcessor.dump_lanes(std::cout);
+			latency_trace::dump(std::cout);
+			inline_hooks::dump(std::cout);
+			unhandled_packets.flush("packet_corpus.bin");
+		});
 }
 
 void intercept_manager::initialize_assets()
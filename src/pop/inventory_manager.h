@@ -25,8 +25,12 @@ public:
 
     std::optional<Item> FindItemByName(const std::string &name) const
     {
-        auto it = std::find_if(items.begin(), items.end(), [&name](const Item &item)
-                               { return item.Name == name; });
+        const name_id id = interned_names.find(name);
+        if (id == no_name)
+            return std::nullopt;
+
+        auto it = std::find_if(items.begin(), items.end(), [id](const Item &item)
+                               { return item.Name == id; });
         if (it != items.end())
         {
             return *it;
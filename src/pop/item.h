@@ -1,10 +1,11 @@
 #pragma once
 #include "pch.h"
+#include "string_interner.h"
 
 class Item
 {
 public:
-    std::string Name;
+    name_id Name = no_name;
     int InventorySlot;
     std::chrono::time_point<std::chrono::system_clock> NextUse;
     uint16_t Icon;
@@ -20,6 +21,6 @@ public:
 
     std::string ToString() const
     {
-        return Name;
+        return std::string(interned_names.view(Name));
     }
 };
\ No newline at end of file
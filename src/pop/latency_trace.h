@@ -0,0 +1,321 @@
+#pragma once
+#include "pch.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+#include "packet_trace.h"
+
+// Log-linear latency histogram in microseconds, after HdrHistogram: values
+// below 2^precision_bits are exact, above that every power of two is split
+// into 2^precision_bits buckets, so any value is reported within about 6%.
+// Recording is one relaxed increment; nothing allocates.
+class latency_histogram
+{
+public:
+    static constexpr unsigned precision_bits = 4;
+    static constexpr unsigned sub_buckets = 1u << precision_bits;
+    // Values are clamped to 2^26 us, about a minute.
+    static constexpr unsigned max_exponent = 26;
+    static constexpr size_t bucket_count = sub_buckets + (max_exponent - precision_bits + 1) * sub_buckets;
+
+    void record(std::chrono::microseconds latency)
+    {
+        const auto us = static_cast<uint64_t>((std::max)(latency.count(), std::chrono::microseconds::rep{0}));
+        counts_[index_of(us)].fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t worst = max_.load(std::memory_order_relaxed);
+        while (worst < us && !max_.compare_exchange_weak(worst, us, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const
+    {
+        return total_.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::microseconds max() const
+    {
+        return std::chrono::microseconds(max_.load(std::memory_order_relaxed));
+    }
+
+    // The smallest bucket value at or below which fraction of the recorded
+    // values fall, e.g. percentile(0.99).
+    std::chrono::microseconds percentile(double fraction) const
+    {
+        const uint64_t total = count();
+        if (total == 0)
+            return std::chrono::microseconds{0};
+
+        const auto wanted = static_cast<uint64_t>(fraction * static_cast<double>(total) + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= (std::max<uint64_t>)(wanted, 1))
+                return std::chrono::microseconds((std::min)(highest_in(i), max_.load(std::memory_order_relaxed)));
+        }
+        return max();
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, bucket_count> counts_{};
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> max_{0};
+
+    static size_t index_of(uint64_t us)
+    {
+        us = (std::min)(us, (uint64_t{1} << (max_exponent + 1)) - 1);
+        if (us < sub_buckets)
+            return static_cast<size_t>(us);
+        const unsigned exponent = static_cast<unsigned>(std::bit_width(us)) - 1;
+        const unsigned shift = exponent - precision_bits;
+        const auto sub = static_cast<size_t>((us >> shift) - sub_buckets);
+        return sub_buckets + shift * sub_buckets + sub;
+    }
+
+    static uint64_t highest_in(size_t index)
+    {
+        if (index < sub_buckets)
+            return index;
+        const size_t shift = (index - sub_buckets) / sub_buckets;
+        const uint64_t sub = (index - sub_buckets) % sub_buckets;
+        return ((sub_buckets + sub + 1) << shift) - 1;
+    }
+};
+
+// The packet whose dispatch is running on this thread, or that caused the
+// task running on it. Anything sent while a cause is set is recorded as a
+// reaction to it.
+struct reaction_cause
+{
+    packet_direction direction = packet_direction::recv;
+    uint8_t opcode = 0;
+    // Capture time in the hook, steady_clock ticks; 0 when there is no cause.
+    int64_t capturedTicks = 0;
+
+    explicit operator bool() const
+    {
+        return capturedTicks != 0;
+    }
+};
+
+// End-to-end latency of the packet pipeline. For every opcode it records how
+// long packets wait between the hook and dispatch, how long dispatch takes,
+// and the two together. For every pair of a triggering packet and an opcode
+// we send while handling it (directly, or from a task or timer the handler
+// posted) it records the time from the trigger leaving the hook to the
+// reaction being sent: an x3A debuff to the cure going out.
+class latency_trace
+{
+public:
+    enum class stage : uint8_t
+    {
+        // Hook to the start of dispatch.
+        queue,
+        // Handler, chain and subscribers.
+        handler,
+        // Hook to the end of dispatch.
+        total,
+    };
+
+    static constexpr size_t stage_count = 3;
+    static constexpr size_t max_reactions = 128;
+
+    struct reaction_stats
+    {
+        packet_direction direction;
+        uint8_t trigger;
+        uint8_t reaction;
+        const latency_histogram *latency;
+    };
+
+    // Makes cause current on this thread until the scope ends.
+    class cause_scope
+    {
+    public:
+        explicit cause_scope(const reaction_cause &cause) : previous_(current_)
+        {
+            current_ = cause;
+        }
+
+        ~cause_scope()
+        {
+            current_ = previous_;
+        }
+
+        cause_scope(const cause_scope &) = delete;
+        cause_scope &operator=(const cause_scope &) = delete;
+
+    private:
+        reaction_cause previous_;
+    };
+
+    static reaction_cause current()
+    {
+        return current_;
+    }
+
+    static void record_dispatch(packet_direction direction, uint8_t opcode, std::chrono::steady_clock::time_point captured,
+                                std::chrono::steady_clock::time_point started, std::chrono::steady_clock::time_point finished)
+    {
+        auto &stages = stages_for(direction, opcode);
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+        stages[static_cast<size_t>(stage::queue)].record(duration_cast<microseconds>(started - captured));
+        stages[static_cast<size_t>(stage::handler)].record(duration_cast<microseconds>(finished - started));
+        stages[static_cast<size_t>(stage::total)].record(duration_cast<microseconds>(finished - captured));
+    }
+
+    // Called for every packet we send; a no-op unless a cause is current.
+    static void note_reaction(uint8_t opcode)
+    {
+        const reaction_cause cause = current_;
+        if (!cause)
+            return;
+
+        const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        if (latency_histogram *latency = reaction_for(cause.direction, cause.opcode, opcode))
+        {
+            latency->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::duration(now - cause.capturedTicks)));
+        }
+    }
+
+    // Null until the opcode has been dispatched with a capture time.
+    static const latency_histogram *stage_of(packet_direction direction, uint8_t opcode, stage which)
+    {
+        const auto *stages = stages_[static_cast<size_t>(direction)][opcode].load(std::memory_order_acquire);
+        return stages != nullptr ? &(*stages)[static_cast<size_t>(which)] : nullptr;
+    }
+
+    static std::vector<reaction_stats> reactions()
+    {
+        std::vector<reaction_stats> out;
+        for (const auto &entry : reactions_)
+        {
+            const uint32_t key = entry.key.load(std::memory_order_acquire);
+            const latency_histogram *latency = entry.latency.load(std::memory_order_acquire);
+            if (key == 0 || latency == nullptr)
+                continue;
+            out.push_back(reaction_stats{static_cast<packet_direction>((key >> 16) & 0xFF),
+                                         static_cast<uint8_t>(key >> 8), static_cast<uint8_t>(key), latency});
+        }
+        return out;
+    }
+
+    // Reactions first, then the total stage of the slowest opcodes.
+    static void dump(std::ostream &out, size_t limit = 16)
+    {
+        const auto opcode_name = [&out](packet_direction direction, uint8_t opcode)
+        {
+            out << (direction == packet_direction::send ? "-> " : "<- ") << std::hex << std::uppercase
+                << std::setw(2) << std::setfill('0') << static_cast<int>(opcode) << std::dec << std::setfill(' ');
+        };
+        const auto summary = [&out](const latency_histogram &h)
+        {
+            out << " n=" << h.count() << " p50=" << h.percentile(0.5).count() << "us p99=" << h.percentile(0.99).count()
+                << "us max=" << h.max().count() << "us";
+        };
+
+        out << "Reaction latency (hook to send):\n";
+        for (const auto &r : reactions())
+        {
+            opcode_name(r.direction, r.trigger);
+            out << " => ";
+            opcode_name(packet_direction::send, r.reaction);
+            summary(*r.latency);
+            out << '\n';
+        }
+
+        struct row
+        {
+            packet_direction direction;
+            uint8_t opcode;
+            const latency_histogram *total;
+            const latency_histogram *queue;
+        };
+        std::vector<row> rows;
+        for (const auto direction : {packet_direction::send, packet_direction::recv})
+        {
+            for (size_t opcode = 0; opcode < 256; ++opcode)
+            {
+                const auto op = static_cast<uint8_t>(opcode);
+                if (const auto *total = stage_of(direction, op, stage::total); total != nullptr && total->count() != 0)
+                    rows.push_back(row{direction, op, total, stage_of(direction, op, stage::queue)});
+            }
+        }
+        std::sort(rows.begin(), rows.end(), [](const row &a, const row &b)
+                  { return a.total->percentile(0.99) > b.total->percentile(0.99); });
+        if (rows.size() > limit)
+            rows.resize(limit);
+
+        out << "Pipeline latency (hook to handled, queue share):\n";
+        for (const auto &r : rows)
+        {
+            opcode_name(r.direction, r.opcode);
+            summary(*r.total);
+            out << " queue p99=" << r.queue->percentile(0.99).count() << "us\n";
+        }
+        out.flush();
+    }
+
+private:
+    using stage_histograms = std::array<latency_histogram, stage_count>;
+
+    struct reaction_entry
+    {
+        std::atomic<uint32_t> key{0};
+        std::atomic<latency_histogram *> latency{nullptr};
+    };
+
+    static inline thread_local reaction_cause current_{};
+    static std::array<std::array<std::atomic<stage_histograms *>, 256>, 2> stages_;
+    static std::array<reaction_entry, max_reactions> reactions_;
+
+    // Allocated the first time the opcode is dispatched.
+    static stage_histograms &stages_for(packet_direction direction, uint8_t opcode)
+    {
+        auto &slot = stages_[static_cast<size_t>(direction)][opcode];
+        if (auto *existing = slot.load(std::memory_order_acquire))
+            return *existing;
+
+        auto *created = new stage_histograms();
+        stage_histograms *expected = nullptr;
+        if (slot.compare_exchange_strong(expected, created, std::memory_order_acq_rel))
+            return *created;
+        delete created;
+        return *expected;
+    }
+
+    // Open addressing over a fixed table; pairs past max_reactions are not
+    // recorded.
+    static latency_histogram *reaction_for(packet_direction direction, uint8_t trigger, uint8_t reaction)
+    {
+        const uint32_t key = uint32_t{1} << 24 | uint32_t{static_cast<uint8_t>(direction)} << 16 | uint32_t{trigger} << 8 | reaction;
+        const size_t start = (key * 2654435761u) % max_reactions;
+        for (size_t i = 0; i < max_reactions; ++i)
+        {
+            auto &entry = reactions_[(start + i) % max_reactions];
+            uint32_t seen = entry.key.load(std::memory_order_acquire);
+            if (seen == 0 && entry.key.compare_exchange_strong(seen, key, std::memory_order_acq_rel))
+            {
+                auto *created = new latency_histogram();
+                entry.latency.store(created, std::memory_order_release);
+                return created;
+            }
+            if (seen == key)
+                return entry.latency.load(std::memory_order_acquire);
+        }
+        return nullptr;
+    }
+};
+
+inline std::array<std::array<std::atomic<latency_trace::stage_histograms *>, 256>, 2> latency_trace::stages_{};
+inline std::array<latency_trace::reaction_entry, latency_trace::max_reactions> latency_trace::reactions_{};
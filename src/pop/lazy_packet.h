@@ -0,0 +1,105 @@
+#pragma once
+#include "pch.h"
+#include <optional>
+#include <string_view>
+#include "decode_result.h"
+#include "packet_layouts.h"
+#include "packet_structures.h"
+#include "packet_view.h"
+
+// An x33 appearance that is only decoded as far as it is read. Construction
+// does one cheap scan: it checks the length and records where the name
+// starts, which depends on which of the two appearance bodies follows Head.
+// Fixed fields are then loaded straight from their offsets and the name and
+// the full PlayerAppearance are decoded on first use and cached.
+//
+// Like PacketView it borrows the packet, which must outlive it.
+class LazyPlayerAppearance
+{
+public:
+    // Opcode, X, Y, facing, serial and head.
+    static constexpr size_t head_offset = 1 + 2 + 2 + 1 + 4;
+    static constexpr size_t body_offset = head_offset + 2;
+
+    explicit LazyPlayerAppearance(const packet &pkt) : pkt_(pkt)
+    {
+        if (pkt_.size() < body_offset)
+        {
+            error_ = decode_error::truncated;
+            return;
+        }
+
+        const size_t bodySize = head() == 0xFFFF
+                                    ? layouts::player_appearance_form::leading_fixed
+                                    : layouts::player_appearance_body::leading_fixed;
+
+        // One padding byte sits between the body and the name.
+        nameOffset_ = body_offset + bodySize + 1;
+        if (pkt_.size() < nameOffset_ + 1 || pkt_.size() - nameOffset_ - 1 < pkt_.data[nameOffset_])
+            error_ = decode_error::truncated;
+    }
+
+    bool ok() const
+    {
+        return error_ == decode_error::none;
+    }
+
+    decode_error error() const
+    {
+        return error_;
+    }
+
+    // The accessors below are only meaningful when ok().
+
+    USHORT x() const
+    {
+        return load_big_endian<USHORT>(pkt_.data + 1);
+    }
+
+    USHORT y() const
+    {
+        return load_big_endian<USHORT>(pkt_.data + 3);
+    }
+
+    Direction facing() const
+    {
+        return static_cast<Direction>(pkt_.data[5]);
+    }
+
+    unsigned int serial() const
+    {
+        return load_big_endian<unsigned int>(pkt_.data + 6);
+    }
+
+    USHORT head() const
+    {
+        return load_big_endian<USHORT>(pkt_.data + head_offset);
+    }
+
+    std::string_view name()
+    {
+        if (!name_)
+        {
+            const size_t len = pkt_.data[nameOffset_];
+            name_ = std::string_view(reinterpret_cast<const char *>(pkt_.data + nameOffset_ + 1), len);
+        }
+        return *name_;
+    }
+
+    const PlayerAppearance &full()
+    {
+        if (!full_)
+        {
+            full_.emplace();
+            schema::decode_into<layouts::player_appearance>(pkt_, *full_);
+        }
+        return *full_;
+    }
+
+private:
+    const packet &pkt_;
+    size_t nameOffset_ = 0;
+    decode_error error_ = decode_error::none;
+    std::optional<std::string_view> name_;
+    std::optional<PlayerAppearance> full_;
+};
@@ -4,8 +4,9 @@
 
 #pragma once
 #include "pch.h"
+#include <array>
 #include "constants.h"
-#include "sprite.h"
+#include "latency_trace.h"
 
 static class game_function
 {
@@ -221,6 +222,8 @@ public:
 		if (length <= 0)
 			return 0;
 
+		latency_trace::note_reaction(packet[0]);
+
 		__try
 		{
 			int cave = reinterpret_cast<int>(
@@ -278,15 +281,90 @@ public:
 		return 0;
 	}
 
+	// Calls the client's send routine directly on a caller-owned buffer,
+	// skipping the code cave. The routine encrypts in place, so the buffer's
+	// contents are not usable afterwards.
+	static int send_buffer_to_server(BYTE *packet, int length)
+	{
+		if (packet == nullptr)
+			return 0;
+
+		if (length <= 0)
+			return 0;
+
+		latency_trace::note_reaction(packet[0]);
+
+		int sender_id = this_pointer();
+
+		if (sender_id <= 0)
+			return -1;
+
+		__try
+		{
+			int send = sendOffset;
+			int packet_length = length;
+
+			__asm
+			{
+				pushfd
+				pushad
+
+				mov edx, packet_length
+				push edx
+
+				mov eax, packet
+				push eax
+
+				mov ecx, [sender_id]
+				call send
+
+				popad
+				popfd
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+		}
+
+		return 0;
+	}
+
 };
 
-#define FACE(direction) game_function::send_to_server(new BYTE[]{0x11, direction, 0x00}, 3);
-#define ASSAIL game_function::send_to_server(new BYTE[]{0x13, 0x01}, 3);
-#define F5 game_function::send_to_server(new BYTE[]{0x38, 0x01}, 3);
-#define ITEM(slot) game_function::send_to_server(new BYTE[]{0x1C, slot}, 3);
-#define SKILL(slot) game_function::send_to_server(new BYTE[]{0x3E, slot, 0x00}, 3);
-#define SPELL(slot) game_function::send_to_server(new BYTE[3]{0x0F, slot, 0x00}, 3);
-#define ITEM_OFF(slot) game_function::send_to_server(new BYTE[3]{0x44, slot, 0x00}, 3);
+// A fixed-shape outgoing packet whose bytes are known at compile time. The
+// values passed to send() patch the bytes after the opcode in a stack copy,
+// which the client then encrypts in place, so sending never allocates.
+template <size_t N>
+struct packet_template
+{
+	std::array<BYTE, N> bytes;
+
+	template <typename... Slots>
+	void send(Slots... values) const
+	{
+		static_assert(sizeof...(Slots) < N, "More slot values than the packet has bytes after its opcode");
+		std::array<BYTE, N> copy = bytes;
+		size_t slot = 1;
+		((copy[slot++] = static_cast<BYTE>(values)), ...);
+		game_function::send_buffer_to_server(copy.data(), static_cast<int>(N));
+	}
+};
+
+namespace outgoing
+{
+	inline constexpr packet_template<3> face{{0x11, 0x00, 0x00}};
+	inline constexpr packet_template<2> assail{{0x13, 0x01}};
+	inline constexpr packet_template<2> refresh{{0x38, 0x01}};
+	inline constexpr packet_template<2> use_item{{0x1C, 0x00}};
+	inline constexpr packet_template<3> use_skill{{0x3E, 0x00, 0x00}};
+	inline constexpr packet_template<3> cast_spell{{0x0F, 0x00, 0x00}};
+	inline constexpr packet_template<3> unequip{{0x44, 0x00, 0x00}};
+}
+
 #define CLICK(id) game_function::click_object(id);
 #define CAN_MOVE game_function::movement_state() == 0x75;
 #define CANNOT_MOVE game_function::movement_state() == 0x74;
+
+// Included last: sprite.h pulls in structures.h, whose inline code calls into
+// game_function and outgoing, so both must be declared first.
+#include "sprite.h"
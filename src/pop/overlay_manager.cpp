@@ -13,6 +13,7 @@
 #include "gamestate_manager.h"
 #include "script_manager.h"
 #include "ui_manager.h"
+#include "task_pool.h"
 
 static HWND g_da_hwnd;
 
@@ -499,6 +500,12 @@ void OverlayManager::run()
 	{
 		try
 		{
+			if (msg.hwnd == nullptr && msg.message == task_pool::ui_task_message)
+			{
+				scheduler.run_ui_tasks();
+				continue;
+			}
+
 			if (msg.message == WM_SETCURSOR)
 				return;
 
@@ -1,27 +1,38 @@
 #pragma once
 #include "pch.h"
+#include "decode_result.h"
 #include "packet_structures.h"
 
-using PacketHandlerFunc = void (*)(const packet &);
+// Handlers report why a packet could not be decoded instead of throwing.
+using PacketHandlerFunc = decode_error (*)(const packet &);
 
-void send_handle_packet_x1C(const packet &packet);
-void send_handle_packet_x38(const packet &packet);
-void send_handle_packet_x10(const packet &packet);
-void send_handle_packet_x0F(const packet &packet);
-void send_handle_packet_x13(const packet &packet);
-void send_handle_packet_x06(const packet &packet);
+decode_error send_handle_packet_x1C(const packet &packet);
+decode_error send_handle_packet_x38(const packet &packet);
+decode_error send_handle_packet_x10(const packet &packet);
+decode_error send_handle_packet_x0F(const packet &packet);
+decode_error send_handle_packet_x13(const packet &packet);
+decode_error send_handle_packet_x06(const packet &packet);
 
-void recv_handle_packet_x04(const packet &packet);
-void recv_handle_packet_x0B(const packet &packet);
-void recv_handle_packet_x0C(const packet &packet);
-void recv_handle_packet_x17(const packet &packet);
-void recv_handle_packet_x0E(const packet &packet);
-void recv_handle_packet_x3A(const packet &packet);
-void recv_handle_packet_x33(const packet &packet);
-void recv_handle_packet_x07(const packet &packet);
-void recv_handle_packet_x29(const packet &packet);
-void recv_handle_packet_x15(const packet &packet);
-void recv_handle_packet_x39(const packet &packet);
-void recv_handle_packet_x10(const packet &packet);
-void recv_handle_packet_x18(const packet &packet);
-void recv_handle_packet_x0F(const packet &packet);
+decode_error recv_handle_packet_x04(const packet &packet);
+decode_error recv_handle_packet_x0B(const packet &packet);
+decode_error recv_handle_packet_x17(const packet &packet);
+decode_error recv_handle_packet_x0E(const packet &packet);
+decode_error recv_handle_packet_x3A(const packet &packet);
+decode_error recv_handle_packet_x07(const packet &packet);
+decode_error recv_handle_packet_x29(const packet &packet);
+decode_error recv_handle_packet_x15(const packet &packet);
+decode_error recv_handle_packet_x39(const packet &packet);
+decode_error recv_handle_packet_x10(const packet &packet);
+decode_error recv_handle_packet_x18(const packet &packet);
+decode_error recv_handle_packet_x0F(const packet &packet);
+
+// Self tests for entity-routed opcodes: true when the packet is about us.
+bool recv_is_self_x0C(const packet &packet);
+bool recv_is_self_x33(const packet &packet);
+
+// Typed subscribers, fed a value decoded once by PacketHandlerRegistry.
+struct EntityWalk;
+struct PlayerAppearance;
+
+void recv_on_entity_walk(const EntityWalk &walk);
+void recv_on_player_appearance(const PlayerAppearance &appearance);
@@ -0,0 +1,350 @@
+#pragma once
+#include "pch.h"
+#include "packet_schema.h"
+#include "structures.h"
+#include "statistics.h"
+#include "item.h"
+#include "spell.h"
+
+// Decoded forms of packets that have no existing model type. Strings are
+// views into the packet and must be copied if kept past the handler.
+
+struct PlayerWalk
+{
+    Direction Facing;
+    USHORT X;
+    USHORT Y;
+};
+
+struct EntityWalk
+{
+    unsigned int Serial;
+    USHORT X;
+    USHORT Y;
+    Direction Facing;
+};
+
+struct EntityRemoval
+{
+    unsigned int Serial;
+};
+
+struct SlotRemoval
+{
+    BYTE Slot;
+};
+
+struct SpellBarUpdate
+{
+    USHORT Icon;
+    BYTE Color;
+};
+
+struct AnimationEvent
+{
+    unsigned int TargetId;
+    unsigned int FromId;
+    USHORT TargetEffect;
+    USHORT FromEffect;
+    USHORT Delay;
+    USHORT X;
+    USHORT Y;
+};
+
+struct SpriteEntry
+{
+    USHORT X;
+    USHORT Y;
+    unsigned int Serial;
+    USHORT Image;
+    BYTE Color;
+    USHORT Display;
+    BYTE Unknown1;
+    BYTE Num4;
+    BYTE Unknown2;
+    BYTE Type;
+    std::string_view Name;
+};
+
+struct SpriteList
+{
+    std::vector<SpriteEntry> Entries;
+};
+
+struct PlayerAppearance
+{
+    USHORT X;
+    USHORT Y;
+    Direction Facing;
+    unsigned int Serial;
+    USHORT Head;
+    USHORT Form;
+    USHORT Body;
+    USHORT Arms;
+    USHORT Boots;
+    USHORT Armor;
+    USHORT Shield;
+    USHORT Weapon;
+    USHORT HeadColor;
+    USHORT BootColor;
+    USHORT Acc1Color;
+    USHORT Acc1;
+    USHORT Acc2Color;
+    USHORT Acc2;
+    BYTE Unknown;
+    USHORT Acc3;
+    BYTE Unknown2;
+    BYTE RestCloak;
+    USHORT Overcoat;
+    USHORT OvercoatColor;
+    USHORT SkinColor;
+    BYTE HideBool;
+    BYTE FaceShape;
+    name_id Name;
+};
+
+// x17 before the level suffix is stripped from the name, so the raw
+// "Name (Lev:n/m)" form is never interned.
+struct SpellSlotUpdate
+{
+    BYTE Slot;
+    USHORT Icon;
+    BYTE Type;
+    std::string_view Name;
+    name_id Prompt;
+    BYTE CastLines;
+};
+
+struct WalkRequest
+{
+    Direction Facing;
+};
+
+struct CastLinesNotice
+{
+    BYTE Lines;
+};
+
+struct CastChant
+{
+    std::string_view Text;
+};
+
+struct CastSpellRequest
+{
+    BYTE Slot;
+    unsigned int Target;
+    USHORT X;
+    USHORT Y;
+};
+
+namespace layouts
+{
+    using namespace schema;
+
+    // Server -> client
+
+    using map_location = packet_layout<0x04, Location,
+        field<USHORT, &Location::X>,
+        field<USHORT, &Location::Y>>;
+
+    using sprite_list = packet_layout<0x07, SpriteList,
+        list<USHORT, &SpriteList::Entries, layout<SpriteEntry,
+            field<USHORT, &SpriteEntry::X>,
+            field<USHORT, &SpriteEntry::Y>,
+            field<unsigned int, &SpriteEntry::Serial>,
+            field<USHORT, &SpriteEntry::Image>,
+            field<BYTE, &SpriteEntry::Color>,
+            field<USHORT, &SpriteEntry::Display>,
+            when<in_range<&SpriteEntry::Image, 0x4000, 0x8000>,
+                field<BYTE, &SpriteEntry::Unknown1>,
+                field<BYTE, &SpriteEntry::Num4>,
+                field<BYTE, &SpriteEntry::Unknown2>,
+                field<BYTE, &SpriteEntry::Type>,
+                when<equals<&SpriteEntry::Type, 0x02>,
+                    string8<&SpriteEntry::Name>>>>>>;
+
+    using stats = packet_layout<0x08, StatsSnapshot,
+        field<char, &StatsSnapshot::BitMask>,
+        when<has_flags<&StatsSnapshot::BitMask, 0x20>,
+            skip<3>,
+            field<char, &StatsSnapshot::Level>,
+            field<char, &StatsSnapshot::Ability>,
+            field<unsigned int, &StatsSnapshot::MaximumHP>,
+            field<unsigned int, &StatsSnapshot::MaximumMP>,
+            field<char, &StatsSnapshot::Str>,
+            field<char, &StatsSnapshot::Int>,
+            field<char, &StatsSnapshot::Wis>,
+            field<char, &StatsSnapshot::Con>,
+            field<char, &StatsSnapshot::Dex>,
+            field<bool, &StatsSnapshot::availablePoints>,
+            field<char, &StatsSnapshot::AvailablePoints>,
+            field<unsigned short, &StatsSnapshot::MaximumWeight>,
+            field<unsigned short, &StatsSnapshot::CurrentWeight>,
+            skip<4>>,
+        when<has_flags<&StatsSnapshot::BitMask, 0x10>,
+            field<unsigned int, &StatsSnapshot::CurrentHP>,
+            field<unsigned int, &StatsSnapshot::CurrentMP>>,
+        when<has_flags<&StatsSnapshot::BitMask, 0x08>,
+            field<unsigned int, &StatsSnapshot::Experience>,
+            field<unsigned int, &StatsSnapshot::ToNextLevel>,
+            field<unsigned int, &StatsSnapshot::AbilityExp>,
+            field<unsigned int, &StatsSnapshot::ToNextAbility>,
+            skip<4>,
+            field<unsigned int, &StatsSnapshot::Gold>>,
+        when<has_flags<&StatsSnapshot::BitMask, 0x04>,
+            field<unsigned short, &StatsSnapshot::BitMask>,
+            skip<1>,
+            field<char, &StatsSnapshot::AttackElement2>,
+            field<char, &StatsSnapshot::DefenseElement2>,
+            field<char, &StatsSnapshot::MailAndParcel>,
+            field<char, &StatsSnapshot::AttackElement>,
+            field<char, &StatsSnapshot::DefenseElement>,
+            field<char, &StatsSnapshot::MagicResistance>,
+            skip<1>,
+            field<char, &StatsSnapshot::ArmorClass>,
+            field<char, &StatsSnapshot::Damage>,
+            field<char, &StatsSnapshot::Hit>>>;
+
+    using player_walk = packet_layout<0x0B, PlayerWalk,
+        field<BYTE, &PlayerWalk::Facing>,
+        field<USHORT, &PlayerWalk::X>,
+        field<USHORT, &PlayerWalk::Y>,
+        expect<in_range<&PlayerWalk::Facing, Direction::North, Direction::West>>>;
+
+    using entity_walk = packet_layout<0x0C, EntityWalk,
+        field<unsigned int, &EntityWalk::Serial>,
+        field<USHORT, &EntityWalk::X>,
+        field<USHORT, &EntityWalk::Y>,
+        field<BYTE, &EntityWalk::Facing>,
+        expect<in_range<&EntityWalk::Facing, Direction::North, Direction::West>>>;
+
+    using entity_removal = packet_layout<0x0E, EntityRemoval,
+        field<unsigned int, &EntityRemoval::Serial>>;
+
+    using add_item = packet_layout<0x0F, Item,
+        field<BYTE, &Item::InventorySlot>,
+        field<USHORT, &Item::Icon>,
+        field<BYTE, &Item::IconPal>,
+        interned8<&Item::Name>,
+        field<unsigned int, &Item::Amount>,
+        field<BYTE, &Item::Stackable>,
+        field<unsigned int, &Item::MaximumDurability>,
+        field<unsigned int, &Item::CurrentDurability>>;
+
+    using remove_item = packet_layout<0x10, SlotRemoval,
+        field<BYTE, &SlotRemoval::Slot>>;
+
+    using add_spell = packet_layout<0x17, SpellSlotUpdate,
+        field<BYTE, &SpellSlotUpdate::Slot>,
+        field<USHORT, &SpellSlotUpdate::Icon>,
+        field<BYTE, &SpellSlotUpdate::Type>,
+        string8<&SpellSlotUpdate::Name>,
+        interned8<&SpellSlotUpdate::Prompt>,
+        field<BYTE, &SpellSlotUpdate::CastLines>>;
+
+    using remove_spell = packet_layout<0x18, SlotRemoval,
+        field<BYTE, &SlotRemoval::Slot>>;
+
+    using animation = packet_layout<0x29, AnimationEvent,
+        field<unsigned int, &AnimationEvent::TargetId>,
+        branch<not_equals<&AnimationEvent::TargetId, 0u>,
+            sequence<
+                field<unsigned int, &AnimationEvent::FromId>,
+                field<USHORT, &AnimationEvent::TargetEffect>,
+                field<USHORT, &AnimationEvent::FromEffect>,
+                field<USHORT, &AnimationEvent::Delay>>,
+            sequence<
+                field<USHORT, &AnimationEvent::TargetEffect>,
+                field<USHORT, &AnimationEvent::Delay>,
+                field<USHORT, &AnimationEvent::X>,
+                field<USHORT, &AnimationEvent::Y>,
+                skip<1>>>>;
+
+    // The two bodies of x33: a monster form when Head is 0xFFFF, otherwise
+    // a dressed aisling. Both are fixed width, which lets LazyPlayerAppearance
+    // find the name without decoding them.
+    using player_appearance_form = sequence<
+        field<USHORT, &PlayerAppearance::Form>,
+        field<BYTE, &PlayerAppearance::Arms>,
+        field<BYTE, &PlayerAppearance::Boots>,
+        field<USHORT, &PlayerAppearance::Armor>,
+        field<BYTE, &PlayerAppearance::Shield>,
+        field<USHORT, &PlayerAppearance::Weapon>,
+        skip<1>>;
+
+    using player_appearance_body = sequence<
+        field<BYTE, &PlayerAppearance::Body>,
+        field<USHORT, &PlayerAppearance::Arms>,
+        field<BYTE, &PlayerAppearance::Boots>,
+        field<USHORT, &PlayerAppearance::Armor>,
+        field<BYTE, &PlayerAppearance::Shield>,
+        field<USHORT, &PlayerAppearance::Weapon>,
+        field<BYTE, &PlayerAppearance::HeadColor>,
+        field<BYTE, &PlayerAppearance::BootColor>,
+        field<BYTE, &PlayerAppearance::Acc1Color>,
+        field<USHORT, &PlayerAppearance::Acc1>,
+        field<BYTE, &PlayerAppearance::Acc2Color>,
+        field<USHORT, &PlayerAppearance::Acc2>,
+        field<BYTE, &PlayerAppearance::Unknown>,
+        field<USHORT, &PlayerAppearance::Acc3>,
+        field<BYTE, &PlayerAppearance::Unknown2>,
+        field<BYTE, &PlayerAppearance::RestCloak>,
+        field<USHORT, &PlayerAppearance::Overcoat>,
+        field<BYTE, &PlayerAppearance::OvercoatColor>,
+        field<BYTE, &PlayerAppearance::SkinColor>,
+        field<BYTE, &PlayerAppearance::HideBool>,
+        field<BYTE, &PlayerAppearance::FaceShape>>;
+
+    using player_appearance = packet_layout<0x33, PlayerAppearance,
+        field<USHORT, &PlayerAppearance::X>,
+        field<USHORT, &PlayerAppearance::Y>,
+        field<BYTE, &PlayerAppearance::Facing>,
+        field<unsigned int, &PlayerAppearance::Serial>,
+        field<USHORT, &PlayerAppearance::Head>,
+        branch<equals<&PlayerAppearance::Head, 0xFFFF>, player_appearance_form, player_appearance_body>,
+        skip<1>,
+        interned8<&PlayerAppearance::Name>>;
+
+    using legend = packet_layout<0x39, Legend,
+        field<BYTE, &Legend::Nation>,
+        string8<&Legend::GuildRank>,
+        string8<&Legend::Title>,
+        string8<&Legend::GroupList>,
+        skip<1>,
+        string8<&Legend::Notes>,
+        field<BYTE, &Legend::Path>,
+        flag<&Legend::Medenian>,
+        flag<&Legend::Master>,
+        string8<&Legend::Class>,
+        string8<&Legend::Guild>,
+        list<BYTE, &Legend::LegendMarks, layout<LegendMark,
+            field<BYTE, &LegendMark::Icon>,
+            field<BYTE, &LegendMark::TextColor>,
+            string8<&LegendMark::MarkID>,
+            string8<&LegendMark::Mark>>>>;
+
+    using spell_bar = packet_layout<0x3A, SpellBarUpdate,
+        field<USHORT, &SpellBarUpdate::Icon>,
+        field<BYTE, &SpellBarUpdate::Color>>;
+
+    // Client -> server
+
+    using walk = packet_layout<0x06, WalkRequest,
+        field<BYTE, &WalkRequest::Facing>,
+        expect<in_range<&WalkRequest::Facing, Direction::North, Direction::West>>>;
+
+    using cast_spell = packet_layout<0x0F, CastSpellRequest,
+        field<BYTE, &CastSpellRequest::Slot>,
+        field<unsigned int, &CastSpellRequest::Target>,
+        field<USHORT, &CastSpellRequest::X>,
+        field<USHORT, &CastSpellRequest::Y>>;
+
+    using cast_lines = packet_layout<0x4D, CastLinesNotice,
+        field<BYTE, &CastLinesNotice::Lines>,
+        skip<1>>;
+
+    using cast_chant = packet_layout<0x4E, CastChant,
+        string8<&CastChant::Text>,
+        skip<1>>;
+}
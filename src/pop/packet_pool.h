@@ -0,0 +1,200 @@
+#pragma once
+#include "pch.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+using BYTE = unsigned char;
+
+// Header that sits in front of every pooled packet's bytes. The reference
+// count lives in the block itself so sharing a captured packet between the
+// queue and its consumers never touches the allocator.
+struct packet_buffer
+{
+    std::atomic<uint32_t> refs{1};
+    uint32_t capacity = 0;
+    uint8_t size_class = 0;
+    uint8_t direction = 0;
+    packet_buffer *next_free = nullptr;
+
+    // Set once at hook time, before the packet is published to the pipeline.
+    uint64_t sequence = 0;
+    int64_t captured_ticks = 0;
+
+    BYTE *bytes()
+    {
+        return reinterpret_cast<BYTE *>(this + 1);
+    }
+};
+
+struct packet_pool_stats
+{
+    uint64_t acquired;
+    uint64_t recycled;
+    uint64_t slab_growths;
+    uint64_t oversized;
+};
+
+// Size-classed free lists of packet buffers. Blocks are carved out of slabs
+// that are allocated once and kept for the life of the process, so after
+// warm-up capturing a packet is a free-list pop plus a memcpy.
+class packet_pool
+{
+public:
+    static constexpr std::array<uint32_t, 5> class_sizes = {64, 256, 1024, 4096, 16384};
+    static constexpr std::array<uint32_t, 5> class_prewarm = {512, 256, 64, 16, 4};
+    static constexpr uint8_t oversized_class = 0xFF;
+    static constexpr size_t slab_bytes = 64 * 1024;
+
+    packet_pool()
+    {
+        for (uint8_t i = 0; i < class_sizes.size(); ++i)
+        {
+            grow(i, class_prewarm[i]);
+        }
+    }
+
+    packet_pool(const packet_pool &) = delete;
+    packet_pool &operator=(const packet_pool &) = delete;
+
+    packet_buffer *acquire(size_t length)
+    {
+        const uint8_t index = class_for(length);
+        stats_.acquired.fetch_add(1, std::memory_order_relaxed);
+
+        if (index == oversized_class)
+        {
+            stats_.oversized.fetch_add(1, std::memory_order_relaxed);
+            auto *raw = new BYTE[sizeof(packet_buffer) + length];
+            auto *buffer = new (raw) packet_buffer();
+            buffer->capacity = static_cast<uint32_t>(length);
+            buffer->size_class = oversized_class;
+            return buffer;
+        }
+
+        auto &list = classes_[index];
+        lock(list);
+        if (list.head == nullptr)
+        {
+            unlock(list);
+            stats_.slab_growths.fetch_add(1, std::memory_order_relaxed);
+            grow(index, blocks_per_slab(index));
+            lock(list);
+        }
+
+        packet_buffer *buffer = list.head;
+        list.head = buffer->next_free;
+        unlock(list);
+
+        buffer->next_free = nullptr;
+        buffer->refs.store(1, std::memory_order_relaxed);
+        return buffer;
+    }
+
+    void release(packet_buffer *buffer)
+    {
+        if (buffer->size_class == oversized_class)
+        {
+            buffer->~packet_buffer();
+            delete[] reinterpret_cast<BYTE *>(buffer);
+            return;
+        }
+
+        stats_.recycled.fetch_add(1, std::memory_order_relaxed);
+        auto &list = classes_[buffer->size_class];
+        lock(list);
+        buffer->next_free = list.head;
+        list.head = buffer;
+        unlock(list);
+    }
+
+    packet_pool_stats stats() const
+    {
+        return {
+            stats_.acquired.load(std::memory_order_relaxed),
+            stats_.recycled.load(std::memory_order_relaxed),
+            stats_.slab_growths.load(std::memory_order_relaxed),
+            stats_.oversized.load(std::memory_order_relaxed)};
+    }
+
+private:
+    struct alignas(64) free_list
+    {
+        std::atomic_flag busy = ATOMIC_FLAG_INIT;
+        packet_buffer *head = nullptr;
+    };
+
+    struct counters
+    {
+        std::atomic<uint64_t> acquired{0};
+        std::atomic<uint64_t> recycled{0};
+        std::atomic<uint64_t> slab_growths{0};
+        std::atomic<uint64_t> oversized{0};
+    };
+
+    std::array<free_list, class_sizes.size()> classes_;
+    counters stats_;
+
+    static uint8_t class_for(size_t length)
+    {
+        for (uint8_t i = 0; i < class_sizes.size(); ++i)
+        {
+            if (length <= class_sizes[i])
+                return i;
+        }
+        return oversized_class;
+    }
+
+    static size_t block_stride(uint8_t index)
+    {
+        return sizeof(packet_buffer) + class_sizes[index];
+    }
+
+    static size_t blocks_per_slab(uint8_t index)
+    {
+        return (std::max)(static_cast<size_t>(1), slab_bytes / block_stride(index));
+    }
+
+    static void lock(free_list &list)
+    {
+        while (list.busy.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+    }
+
+    static void unlock(free_list &list)
+    {
+        list.busy.clear(std::memory_order_release);
+    }
+
+    // Slabs are intentionally never returned: packets can still be in flight
+    // on the dispatch threads while the DLL is tearing down.
+    void grow(uint8_t index, size_t count)
+    {
+        const size_t stride = block_stride(index);
+        BYTE *slab = new BYTE[stride * count];
+
+        packet_buffer *first = nullptr;
+        packet_buffer *last = nullptr;
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto *buffer = new (slab + i * stride) packet_buffer();
+            buffer->capacity = class_sizes[index];
+            buffer->size_class = index;
+            if (last != nullptr)
+                last->next_free = buffer;
+            else
+                first = buffer;
+            last = buffer;
+        }
+
+        auto &list = classes_[index];
+        lock(list);
+        last->next_free = list.head;
+        list.head = first;
+        unlock(list);
+    }
+};
+
+inline packet_pool packet_buffers;
@@ -2,64 +2,378 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <array>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <ostream>
 
+#include "packet_registry.h"
 #include "packet_structures.h"
+#include "task_pool.h"
 #include "worker.h"
 
+// Point-in-time view of one priority class, summed over every dispatch lane.
+struct lane_snapshot
+{
+    size_t depth = 0;
+    size_t peak_depth = 0;
+    uint64_t dispatched = 0;
+    // Dispatches granted by the starvation rule rather than by priority.
+    uint64_t starved = 0;
+    // Waiting packets discarded because a newer one for the same serial
+    // arrived.
+    uint64_t coalesced = 0;
+    // Time from interception to dispatch.
+    std::chrono::microseconds mean_wait{0};
+    std::chrono::microseconds max_wait{0};
+};
+
+// Send and recv packets enter one channel, stamped with a global sequence
+// number and capture time under the producer flag, so the channel's order is
+// the order the hooks saw them in. The ordered lane dispatches total-order
+// opcodes in that order, which is what keeps an outgoing walk (x06) and the
+// server's answer (x0B) from racing on our own location. Opcodes registered
+// as dispatch_order::any are forwarded to the parallel lane so slow handlers
+// cannot hold up the ordered stream. dispatch_order::entity opcodes are
+// hashed by serial onto one of several shards, so each entity's updates stay
+// in order while different entities are handled on different cores.
+//
+// Lanes own no threads. Each is drained by at most one task on the shared
+// task_pool at a time, scheduled by the push that finds it idle, and a task
+// gives its worker back after task_budget dispatches so one busy lane cannot
+// hold a core.
+//
+// Overload is handled per opcode (see overload_policy): a full channel drops
+// and counts droppable packets, spills never_drop ones, and redundant
+// updates still waiting in the lanes are collapsed to the newest.
+//
+// Within the parallel and shard lanes, packets then wait in per-priority
+// FIFOs so a combat update never queues behind a map load's sprite lists.
+// The channel is re-checked between dispatches, so a packet that arrives
+// mid-burst is served next if its class is higher than the rest of the
+// backlog. The ordered lane never reorders: a self x0C must not overtake
+// the x04/x0B/x06 ahead of it, so its packets leave in channel order
+// whatever their class.
 class PacketProcessor
 {
+public:
+    // Enough for a full map load of x07/x33 bursts; a push into a full
+    // channel is dropped and counted rather than stalling the game thread.
+    static constexpr size_t channel_capacity = 4096;
+
+    // A lower class is served at least once per this many higher-class
+    // dispatches while it has work waiting.
+    static constexpr uint32_t starvation_limit = 8;
+
+    // Decoded values are retired at least this often during a long backlog.
+    static constexpr size_t retire_interval = 64;
+
+    // Dispatches a lane task makes before yielding its worker.
+    static constexpr size_t task_budget = 256;
+
 private:
-    ThreadSafeQueue<std::shared_ptr<packet>> sendQueue;
-    ThreadSafeQueue<std::shared_ptr<packet>> recvQueue;
-    std::vector<std::thread> workerThreads;
-    std::atomic<bool> stopFlag{false};
+    struct lane_counters
+    {
+        std::atomic<size_t> depth{0};
+        std::atomic<size_t> peakDepth{0};
+        std::atomic<uint64_t> dispatched{0};
+        std::atomic<uint64_t> starved{0};
+        std::atomic<uint64_t> coalesced{0};
+        std::atomic<uint64_t> totalWaitUs{0};
+        std::atomic<uint64_t> maxWaitUs{0};
+    };
+
+    // A channel and the priority FIFOs its packets wait in. Only the lane's
+    // single scheduled task touches waiting. An unprioritized lane still
+    // counts its packets per class but dispatches them in arrival order.
+    struct lane
+    {
+        PacketChannel<packet, channel_capacity> channel;
+        PriorityLanes<packet, packet_priority_count> waiting;
+        bool forwards = false;
 
-    void processSendQueue()
+        explicit lane(bool prioritized = true) : waiting(starvation_limit, prioritized) {}
+    };
+
+    task_pool &pool;
+    lane orderedLane{false};
+    lane parallelLane;
+    std::vector<std::unique_ptr<lane>> shardLanes;
+    std::array<lane_counters, packet_priority_count> laneCounters;
+    std::atomic<uint64_t> nextSequence{1};
+
+    template <typename U>
+    static void raise_to(std::atomic<U> &target, U value)
     {
-        while (!stopFlag)
+        U current = target.load(std::memory_order_relaxed);
+        while (current < value && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
         {
-            std::shared_ptr<packet> pkt;
-            sendQueue.wait_and_pop(pkt);
-            intercept_manager::on_packet_send(pkt.get());
         }
     }
 
-    void processRecvQueue()
+    static void dispatch(packet &pkt)
+    {
+        if (pkt.direction() == packet_direction::send)
+            intercept_manager::on_packet_send(&pkt);
+        else
+            intercept_manager::on_packet_recv(&pkt);
+    }
+
+    static bool neverDrop(packet_direction direction, const packet &pkt)
     {
-        while (!stopFlag)
+        return PacketHandlerRegistry::policy_of(direction, pkt.data[0]).overload == overload_policy::never_drop;
+    }
+
+    void enqueue(packet pkt, packet_direction direction)
+    {
+        const auto stamp = [this, direction](packet &p)
+        { p.stamp(nextSequence.fetch_add(1, std::memory_order_relaxed), direction); };
+
+        if (neverDrop(direction, pkt))
+            orderedLane.channel.push_or_spill(std::move(pkt), stamp);
+        else
+            orderedLane.channel.push(std::move(pkt), stamp);
+    }
+
+    // Hands a packet to another lane under its overload policy.
+    static void forward(lane &target, packet &pkt)
+    {
+        if (neverDrop(pkt.direction(), pkt))
+            target.channel.push_or_spill(std::move(pkt), [](packet &) {});
+        else
+            target.channel.push(std::move(pkt));
+    }
+
+    // Fibonacci hashing spreads sequential serials across shards.
+    lane &shardFor(uint32_t serial)
+    {
+        const size_t hash = static_cast<uint32_t>(serial * 0x9E3779B1u) >> 16;
+        return *shardLanes[hash % shardLanes.size()];
+    }
+
+    // Ordered lane only: sends any and entity packets on to their lanes.
+    // Returns true for packets it has taken.
+    bool route(packet &pkt)
+    {
+        const auto &policy = PacketHandlerRegistry::policy_of(pkt.direction(), pkt.data[0]);
+        switch (policy.order.load(std::memory_order_relaxed))
         {
-            std::shared_ptr<packet> pkt;
-            recvQueue.wait_and_pop(pkt);
-            intercept_manager::on_packet_recv(pkt.get());
+        case dispatch_order::any:
+            forward(parallelLane, pkt);
+            return true;
+        case dispatch_order::entity:
+            if (policy.affects_self != nullptr && policy.affects_self(pkt))
+                return false;
+            if (const auto serial = PacketHandlerRegistry::serial_of(pkt))
+            {
+                forward(shardFor(*serial), pkt);
+                return true;
+            }
+            return false;
+        default:
+            return false;
         }
     }
 
-public:
-    PacketProcessor()
+    void admit(lane &l, packet &pkt)
     {
-        workerThreads.emplace_back(&PacketProcessor::processSendQueue, this);
-        workerThreads.emplace_back(&PacketProcessor::processRecvQueue, this);
+        if (l.forwards && route(pkt))
+            return;
+
+        const auto priority = static_cast<size_t>(PacketHandlerRegistry::priority_of(pkt.direction(), pkt.data[0]));
+        auto &counters = laneCounters[priority];
+        const uint64_t key = PacketHandlerRegistry::coalesce_key(pkt);
+        if (l.waiting.push(std::move(pkt), priority, key))
+        {
+            counters.coalesced.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        raise_to(counters.peakDepth, counters.depth.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    void record(size_t priority, const packet &pkt, bool starved)
+    {
+        auto &counters = laneCounters[priority];
+        counters.depth.fetch_sub(1, std::memory_order_relaxed);
+        const auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - pkt.captured_at())
+                                .count();
+        counters.dispatched.fetch_add(1, std::memory_order_relaxed);
+        counters.totalWaitUs.fetch_add(waited, std::memory_order_relaxed);
+        raise_to(counters.maxWaitUs, static_cast<uint64_t>(waited));
+        if (starved)
+            counters.starved.fetch_add(1, std::memory_order_relaxed);
     }
 
-    ~PacketProcessor()
+    // One scheduled run of a lane. Pulls from the channel into the priority
+    // FIFOs and dispatches one packet at a time until both are empty or the
+    // budget is spent.
+    void drain(lane &l)
     {
-        stopFlag = true;
-        for (auto &thread : workerThreads)
+        const auto take = [this, &l](packet &pkt)
+        { admit(l, pkt); };
+
+        size_t sinceRetire = 0;
+        for (size_t dispatched = 0;;)
         {
-            if (thread.joinable())
+            // The FIFOs hold at most one channel's worth, so a lane that falls
+            // behind lets its channel fill and drop instead of growing.
+            l.channel.drain(take, channel_capacity - (std::min)(l.waiting.size(), channel_capacity));
+
+            packet pkt;
+            bool starved = false;
+            if (const size_t priority = l.waiting.pop(pkt, starved); priority != packet_priority_count)
             {
-                thread.join();
+                record(priority, pkt, starved);
+                PacketHandlerRegistry::note_backlog(l.waiting.size() + l.channel.depth());
+                dispatch(pkt);
+
+                if (++sinceRetire == retire_interval)
+                {
+                    PacketHandlerRegistry::retire_batch();
+                    sinceRetire = 0;
+                }
+                if (++dispatched == task_budget)
+                {
+                    PacketHandlerRegistry::retire_batch();
+                    pool.post_untraced([this, &l]
+                                       { drain(l); });
+                    return;
+                }
+                continue;
             }
+
+            PacketHandlerRegistry::retire_batch();
+            sinceRetire = 0;
+            if (!l.channel.release())
+                return;
         }
     }
 
-    void enqueueSend(std::shared_ptr<packet> pkt)
+    void attach(lane &l)
     {
-        sendQueue.push(std::move(pkt));
+        l.channel.set_schedule([this, &l]
+                               { pool.post_untraced([this, &l]
+                                                    { drain(l); }); });
     }
 
-    void enqueueRecv(std::shared_ptr<packet> pkt)
+public:
+    static size_t default_shard_count()
     {
-        recvQueue.push(std::move(pkt));
+        return std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+    }
+
+    explicit PacketProcessor(task_pool &pool = scheduler, size_t shard_count = default_shard_count()) : pool(pool)
+    {
+        for (size_t i = 0; i < (std::max)(shard_count, size_t{1}); ++i)
+            shardLanes.push_back(std::make_unique<lane>());
+
+        orderedLane.forwards = true;
+        attach(orderedLane);
+        attach(parallelLane);
+        for (auto &shard : shardLanes)
+            attach(*shard);
+    }
+
+    PacketProcessor(const PacketProcessor &other) = delete;
+    PacketProcessor &operator=(const PacketProcessor &other) = delete;
+
+    void enqueueSend(packet pkt)
+    {
+        enqueue(std::move(pkt), packet_direction::send);
+    }
+
+    void enqueueRecv(packet pkt)
+    {
+        enqueue(std::move(pkt), packet_direction::recv);
+    }
+
+    size_t orderedDepth() const
+    {
+        return orderedLane.channel.depth();
+    }
+
+    size_t parallelDepth() const
+    {
+        return parallelLane.channel.depth();
+    }
+
+    size_t shardCount() const
+    {
+        return shardLanes.size();
+    }
+
+    size_t shardDepth(size_t shard) const
+    {
+        return shardLanes[shard]->channel.depth();
+    }
+
+    uint64_t droppedPackets() const
+    {
+        uint64_t total = orderedLane.channel.dropped_count() + parallelLane.channel.dropped_count();
+        for (const auto &shard : shardLanes)
+            total += shard->channel.dropped_count();
+        return total;
+    }
+
+    // never_drop packets that arrived while a channel was full.
+    uint64_t spilledPackets() const
+    {
+        uint64_t total = orderedLane.channel.spilled_count() + parallelLane.channel.spilled_count();
+        for (const auto &shard : shardLanes)
+            total += shard->channel.spilled_count();
+        return total;
+    }
+
+    uint64_t coalescedPackets() const
+    {
+        uint64_t total = 0;
+        for (const auto &counters : laneCounters)
+            total += counters.coalesced.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    lane_snapshot laneStats(packet_priority priority) const
+    {
+        const auto &counters = laneCounters[static_cast<size_t>(priority)];
+        lane_snapshot snapshot;
+        snapshot.depth = counters.depth.load(std::memory_order_relaxed);
+        snapshot.peak_depth = counters.peakDepth.load(std::memory_order_relaxed);
+        snapshot.dispatched = counters.dispatched.load(std::memory_order_relaxed);
+        snapshot.starved = counters.starved.load(std::memory_order_relaxed);
+        snapshot.coalesced = counters.coalesced.load(std::memory_order_relaxed);
+        if (snapshot.dispatched != 0)
+            snapshot.mean_wait = std::chrono::microseconds(counters.totalWaitUs.load(std::memory_order_relaxed) / snapshot.dispatched);
+        snapshot.max_wait = std::chrono::microseconds(counters.maxWaitUs.load(std::memory_order_relaxed));
+        return snapshot;
+    }
+
+    // One line per priority class, what each dispatch lane's channel holds
+    // right now, and what the overload policies have discarded or spilled.
+    void dump_lanes(std::ostream &out) const
+    {
+        static constexpr const char *class_names[packet_priority_count] = {"combat", "normal", "bulk"};
+
+        out << "Dispatch lanes (by priority class):\n";
+        for (size_t i = 0; i < packet_priority_count; ++i)
+        {
+            const auto s = laneStats(static_cast<packet_priority>(i));
+            out << class_names[i]
+                << " depth=" << s.depth << "/" << s.peak_depth
+                << " n=" << s.dispatched
+                << " starved=" << s.starved
+                << " coalesced=" << s.coalesced
+                << " wait=" << s.mean_wait.count() << "/" << s.max_wait.count() << "us\n";
+        }
+
+        out << "Channel depth: ordered=" << orderedDepth() << " parallel=" << parallelDepth() << " shards=";
+        for (size_t i = 0; i < shardLanes.size(); ++i)
+            out << (i != 0 ? "," : "") << shardDepth(i);
+        out << '\n';
+        out << "Overload: dropped=" << droppedPackets() << " spilled=" << spilledPackets()
+            << " coalesced=" << coalescedPackets() << '\n';
+        out.flush();
     }
 };
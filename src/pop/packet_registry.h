@@ -1,18 +1,413 @@
 #pragma once
 #include "pch.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <vector>
+#include "decode_arena.h"
 #include "packet_handler.h"
+#include "packet_schema.h"
+
+// Typed consumers of one opcode. The packet is decoded once per dispatch into
+// the batch's arena and every subscriber gets the same const reference, which
+// stays valid until the batch is retired.
+struct decoded_route
+{
+	using decode_fn = const void *(*)(const packet &, decode_arena &, decode_error &);
+
+	decode_fn decode = nullptr;
+	std::vector<std::function<void(const void *)>> subscribers;
+};
+
+// Where the pipeline may run an opcode's handler and subscribers.
+enum class dispatch_order : uint8_t
+{
+	// On the ordered lane, in global send/recv sequence with every other
+	// total-order opcode. Anything that reads or writes our own state.
+	total,
+	// On the parallel lane, in arrival order among themselves but not
+	// against the ordered lane. Slow or self-contained work.
+	any,
+	// On the entity shard chosen by the packet's serial: in order with every
+	// other entity opcode about the same serial, in parallel with the rest.
+	// A packet the opcode's self test claims runs on the ordered lane instead.
+	entity,
+};
+
+// Which dispatch lane an opcode waits in. Lanes are served in this order;
+// see PriorityLanes for the starvation rule. Packets only overtake packets of
+// a lower class, and only on the parallel and shard lanes: the ordered lane
+// keeps arrival order whatever the class.
+enum class packet_priority : uint8_t
+{
+	// Reactive combat state: animations, movement, spell bar.
+	combat,
+	normal,
+	// Large, latency-tolerant dumps: sprite lists, legends.
+	bulk,
+};
+
+constexpr size_t packet_priority_count = 3;
+
+// What the pipeline may do with an opcode when it is behind.
+enum class overload_policy : uint8_t
+{
+	// Dropped and counted when the channel is full.
+	droppable,
+	// As droppable, and a waiting packet with the same opcode and serial is
+	// superseded by the newer one instead of both being dispatched.
+	coalesce,
+	// Never dropped: spills to an overflow list when the channel is full.
+	// Keep this to opcodes that are rare and whose loss corrupts state.
+	never_drop,
+};
+
+// Time a handler and its subscribers may take per packet before the run is
+// recorded as a stall.
+constexpr std::chrono::microseconds default_handler_budget{2000};
+
+// One handler invocation that ran past its opcode's budget.
+struct handler_stall
+{
+	packet_direction direction;
+	uint8_t opcode;
+	std::chrono::microseconds duration;
+	// Packets queued on the same lane behind the stalled one.
+	size_t backlog;
+	uint64_t sequence;
+};
+
+// Traffic and cost of one opcode in one direction since startup.
+struct opcode_stats
+{
+	// Handler time histogram: bucket 0 is under 1us, bucket i covers
+	// [2^(i-1), 2^i) us and the last bucket everything from 2^14 us up.
+	static constexpr size_t histogram_buckets = 16;
+
+	uint64_t packets = 0;
+	uint64_t bytes = 0;
+	uint32_t malformed = 0;
+	// Handler, chain and subscribers together. route_decode_time is only the
+	// part spent decoding once for typed subscribers; a handler or chain link
+	// that decodes for itself is counted in handler_time alone.
+	std::chrono::nanoseconds handler_time{0};
+	std::chrono::nanoseconds route_decode_time{0};
+	// From capture in the hook to the start of dispatch.
+	std::chrono::microseconds queue_wait{0};
+	std::chrono::microseconds max_queue_wait{0};
+	std::array<uint64_t, histogram_buckets> handler_histogram{};
+
+	std::chrono::nanoseconds mean_handler_time() const
+	{
+		return packets != 0 ? handler_time / static_cast<int64_t>(packets) : std::chrono::nanoseconds{0};
+	}
+
+	std::chrono::microseconds mean_queue_wait() const
+	{
+		return packets != 0 ? queue_wait / static_cast<int64_t>(packets) : std::chrono::microseconds{0};
+	}
+};
+
+// Everything the pipeline knows about one opcode in one direction.
+struct opcode_policy
+{
+	// Atomic because register_*_handlers may move an opcode to another lane
+	// while the ordered lane is routing it.
+	std::atomic<dispatch_order> order{dispatch_order::total};
+	packet_priority priority = packet_priority::normal;
+	overload_policy overload = overload_policy::droppable;
+	// Where the big-endian serial sits, for coalescing and entity routing;
+	// 0 when the opcode carries none.
+	uint8_t serial_offset = 0;
+	// For dispatch_order::entity: true when the packet is about us and must
+	// stay in order with the self-state handlers.
+	bool (*affects_self)(const packet &) = nullptr;
+	std::chrono::microseconds budget = default_handler_budget;
+};
+
+// What a chain subscriber tells the subscribers after it.
+enum class chain_result : uint8_t
+{
+	next,
+	// Subscribers further down the chain do not see this packet.
+	stop,
+};
+
+using chain_subscriber = std::function<chain_result(const packet &)>;
+using subscription_id = uint32_t;
+
+// The subscribers of one opcode, highest priority first and, within a
+// priority, in the order they subscribed. A published chain is never
+// modified: subscribing builds a new one and swaps it in.
+struct handler_chain
+{
+	struct link
+	{
+		int priority;
+		subscription_id id;
+		chain_subscriber subscriber;
+	};
+
+	std::vector<link> links;
+};
+
+// One entry of the handler list compiled into the dispatch tables.
+struct handler_binding
+{
+	uint8_t opcode;
+	PacketHandlerFunc handler;
+	dispatch_order order = dispatch_order::total;
+};
 
 class PacketHandlerRegistry
 {
 public:
-	static void register_send_handlers(uint8_t opcode, PacketHandlerFunc handler);
-	static void register_recv_handlers(uint8_t opcode, PacketHandlerFunc handler);
+	// The built-in handlers are compiled into the tables (see
+	// handle_registry.cpp). These swap a slot at runtime, for handlers that
+	// are not built in or to override one that is. The opcode keeps its
+	// dispatch order unless one is given.
+	static void register_send_handlers(uint8_t opcode, PacketHandlerFunc handler, std::optional<dispatch_order> order = std::nullopt);
+	static void register_recv_handlers(uint8_t opcode, PacketHandlerFunc handler, std::optional<dispatch_order> order = std::nullopt);
 	static void handle_outgoing_data(const packet &pkt);
 	static void handle_incoming_data(const packet &pkt);
 
+	// Adds a subscriber to the opcode's chain. Chain subscribers run after
+	// the opcode's handler, on the same dispatch lane, and may be added or
+	// removed at any time: dispatch walks whichever chain was current when
+	// the packet started and never waits for a registration.
+	static subscription_id subscribe_chain(packet_direction direction, uint8_t opcode, int priority, chain_subscriber subscriber);
+	static void unsubscribe_chain(subscription_id id);
+
+	// Subscribers are registered during initialize_handlers, before the
+	// dispatch threads see any packets. All subscribers of an opcode must use
+	// the same layout.
+	template <typename Layout>
+	static void subscribe_send(void (*subscriber)(const typename Layout::type &))
+	{
+		subscribe<Layout>(send_routes_, subscriber);
+	}
+
+	template <typename Layout>
+	static void subscribe_recv(void (*subscriber)(const typename Layout::type &))
+	{
+		subscribe<Layout>(recv_routes_, subscriber);
+	}
+
+	static const opcode_policy &policy_of(packet_direction direction, uint8_t opcode)
+	{
+		return direction == packet_direction::send ? send_policy_[opcode] : recv_policy_[opcode];
+	}
+
+	static dispatch_order order_of(packet_direction direction, uint8_t opcode)
+	{
+		return policy_of(direction, opcode).order.load(std::memory_order_relaxed);
+	}
+
+	// Policies below default to total order, normal priority and droppable.
+	// Set them during initialize_handlers, before the dispatch threads see
+	// any packets.
+	static void set_dispatch_order(packet_direction direction, uint8_t opcode, dispatch_order order)
+	{
+		policy(direction, opcode).order.store(order, std::memory_order_relaxed);
+	}
+
+	static void set_serial_offset(packet_direction direction, uint8_t opcode, uint8_t serial_offset, bool (*affects_self)(const packet &) = nullptr)
+	{
+		auto &entry = policy(direction, opcode);
+		entry.serial_offset = serial_offset;
+		entry.affects_self = affects_self;
+	}
+
+	static void set_priority(packet_direction direction, uint8_t opcode, packet_priority priority)
+	{
+		policy(direction, opcode).priority = priority;
+	}
+
+	static packet_priority priority_of(packet_direction direction, uint8_t opcode)
+	{
+		return policy_of(direction, opcode).priority;
+	}
+
+	static void set_budget(packet_direction direction, uint8_t opcode, std::chrono::microseconds budget)
+	{
+		policy(direction, opcode).budget = budget;
+	}
+
+	static void set_overload_policy(packet_direction direction, uint8_t opcode, overload_policy overload)
+	{
+		policy(direction, opcode).overload = overload;
+	}
+
+	static std::optional<uint32_t> serial_of(const packet &pkt)
+	{
+		const auto &entry = policy_of(pkt.direction(), pkt.data[0]);
+		if (entry.serial_offset == 0 || pkt.size() < entry.serial_offset + size_t{4})
+			return std::nullopt;
+		return load_big_endian<uint32_t>(pkt.data + entry.serial_offset);
+	}
+
+	// Identifies what a coalescible packet supersedes: direction, opcode and
+	// serial. 0 when the opcode does not coalesce or the packet is too short
+	// to carry a serial.
+	static uint64_t coalesce_key(const packet &pkt)
+	{
+		if (policy_of(pkt.direction(), pkt.data[0]).overload != overload_policy::coalesce)
+			return 0;
+		const auto serial = serial_of(pkt);
+		if (!serial)
+			return 0;
+		return uint64_t{1} << 48 |
+			   uint64_t{static_cast<uint8_t>(pkt.direction())} << 40 |
+			   uint64_t{pkt.data[0]} << 32 |
+			   *serial;
+	}
+
+	// Ends the calling thread's dispatch batch: everything it decoded for
+	// subscribers since the last call is destroyed.
+	static void retire_batch();
+
+	// Called by the dispatcher just before handing a packet over: how many
+	// packets wait behind it on this thread's lane, recorded with any stall.
+	static void note_backlog(size_t backlog);
+
+	// Reports handlers that are still running well past their budget. Run
+	// periodically from outside the dispatch lanes, since a blocked handler
+	// cannot report itself.
+	static void check_in_flight();
+
+	// Counters are updated by the dispatch lanes without locks and may be
+	// read at any time; a snapshot is consistent per field, not across them.
+	static opcode_stats stats_of(packet_direction direction, uint8_t opcode);
+
+	// One line per opcode that saw traffic, the costliest handlers first.
+	static void dump_stats(std::ostream &out, size_t limit = 16);
+
+	static uint32_t overrun_count(packet_direction direction, uint8_t opcode);
+	static std::chrono::microseconds worst_handler_time(packet_direction direction, uint8_t opcode);
+	// The most recent overruns, oldest first.
+	static std::vector<handler_stall> recent_stalls();
+
+	// Number of packets per opcode that a handler rejected as malformed.
+	static uint32_t malformed_send_count(uint8_t opcode);
+	static uint32_t malformed_recv_count(uint8_t opcode);
+
 private:
-	static std::unordered_map<uint8_t, PacketHandlerFunc> recv_handlers_;
-	static std::unordered_map<uint8_t, PacketHandlerFunc> send_handlers_;
+	// Indexed by opcode; an empty slot means no handler.
+	static std::array<std::atomic<PacketHandlerFunc>, 256> recv_handlers_;
+	static std::array<std::atomic<PacketHandlerFunc>, 256> send_handlers_;
+
+	static std::array<std::atomic<const handler_chain *>, 256> recv_chains_;
+	static std::array<std::atomic<const handler_chain *>, 256> send_chains_;
+
+	// A replaced chain, with the time it was replaced. It is freed once no
+	// dispatch thread has been inside a handler since before that time.
+	struct retired_chain
+	{
+		const handler_chain *chain;
+		int64_t retiredTicks;
+	};
+
+	static std::mutex chains_mutex_;
+	static std::vector<retired_chain> retired_chains_;
+	static subscription_id next_subscription_;
+
+	static std::array<decoded_route, 256> recv_routes_;
+	static std::array<decoded_route, 256> send_routes_;
+	static std::array<opcode_policy, 256> recv_policy_;
+	static std::array<opcode_policy, 256> send_policy_;
+
+	static opcode_policy &policy(packet_direction direction, uint8_t opcode)
+	{
+		return direction == packet_direction::send ? send_policy_[opcode] : recv_policy_[opcode];
+	}
+
+	// Each dispatch lane decodes into its own arena.
+	static decode_arena &arena();
+
+	static std::array<std::atomic<uint32_t>, 256> malformed_send_;
+	static std::array<std::atomic<uint32_t>, 256> malformed_recv_;
+
+	// Own cache line per opcode, so lanes dispatching different opcodes do
+	// not contend.
+	struct alignas(64) opcode_counters
+	{
+		std::atomic<uint64_t> packets{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> handlerNs{0};
+		std::atomic<uint64_t> routeDecodeNs{0};
+		std::atomic<uint64_t> waitUs{0};
+		std::atomic<uint64_t> maxWaitUs{0};
+		std::array<std::atomic<uint64_t>, opcode_stats::histogram_buckets> histogram{};
+		std::atomic<uint32_t> overruns{0};
+		std::atomic<uint32_t> worstUs{0};
+	};
+
+	// What one dispatch thread is running, for check_in_flight.
+	struct in_flight
+	{
+		std::atomic<int64_t> startedTicks{0};
+		std::atomic<uint16_t> what{0};
+		std::atomic<size_t> backlog{0};
+		int64_t reportedTicks = 0;
+	};
+
+	static constexpr size_t stall_history = 64;
+	// check_in_flight reports a handler once it has run this many budgets.
+	static constexpr int stall_factor = 4;
+
+	static std::array<opcode_counters, 256> send_counters_;
+	static std::array<opcode_counters, 256> recv_counters_;
+
+	static opcode_counters &counters(packet_direction direction, uint8_t opcode)
+	{
+		return (direction == packet_direction::send ? send_counters_ : recv_counters_)[opcode];
+	}
+	static std::mutex stalls_mutex_;
+	static std::array<handler_stall, stall_history> stalls_;
+	static size_t stall_count_;
+	static std::mutex in_flight_mutex_;
+	static std::vector<std::shared_ptr<in_flight>> in_flight_;
+
+	static in_flight &in_flight_slot();
+
+	static void run_chain(const std::atomic<const handler_chain *> &slot, const packet &pkt);
+	static void replace_chain(std::atomic<const handler_chain *> &slot, const handler_chain *chain);
+	static void reclaim_chains();
+
+	template <typename Handle>
+	static void run_timed(packet_direction direction, const packet &pkt, Handle &&handle);
+
+	static void record_overrun(packet_direction direction, const packet &pkt, std::chrono::microseconds elapsed, size_t backlog);
+
+	static void record_malformed(std::array<std::atomic<uint32_t>, 256> &counters, const packet &pkt, decode_error error);
+
+	static void publish(
+		decoded_route &route,
+		std::array<std::atomic<uint32_t>, 256> &malformed,
+		opcode_counters &stats,
+		const packet &pkt);
+
+	template <typename Layout>
+	static const void *decode_into_arena(const packet &pkt, decode_arena &arena, decode_error &error)
+	{
+		auto *value = arena.make<typename Layout::type>();
+		error = schema::decode_into<Layout>(pkt, *value);
+		return value;
+	}
+
+	template <typename Layout>
+	static void subscribe(std::array<decoded_route, 256> &routes, void (*subscriber)(const typename Layout::type &))
+	{
+		auto &route = routes[Layout::opcode];
+		route.decode = &decode_into_arena<Layout>;
+		route.subscribers.emplace_back([subscriber](const void *value)
+									   { subscriber(*static_cast<const typename Layout::type *>(value)); });
+	}
 };
 
 inline PacketHandlerRegistry handler_registry;
@@ -0,0 +1,231 @@
+#pragma once
+#include "pch.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "packet_structures.h"
+
+// Keeps example payloads of the opcodes nothing handles, so new layouts can be
+// worked out from a corpus instead of the console. Each opcode's samples are
+// grouped by packet length: the first length_groups distinct lengths get a
+// group each and any further lengths share one. Every group is a reservoir of
+// samples_per_group packets drawn uniformly from all it has seen, so memory
+// per opcode is fixed however long the session runs.
+//
+// Corpus format, little-endian:
+//   header  "DACP", u16 version, u16 max_sample_bytes
+//   record  u8 direction, u8 opcode, u32 seen by the sample's group,
+//           u16 packet length, u16 stored length, stored bytes
+// Packets longer than max_sample_bytes are stored truncated.
+class packet_sampler
+{
+public:
+    static constexpr size_t length_groups = 4;
+    static constexpr size_t samples_per_group = 4;
+    static constexpr size_t max_sample_bytes = 256;
+    static constexpr uint16_t corpus_version = 1;
+
+    packet_sampler() = default;
+    packet_sampler(const packet_sampler &) = delete;
+    packet_sampler &operator=(const packet_sampler &) = delete;
+
+    ~packet_sampler()
+    {
+        for (auto &direction : reservoirs_)
+        {
+            for (auto &slot : direction)
+                delete slot.load(std::memory_order_relaxed);
+        }
+    }
+
+    void sample(packet_direction direction, const packet &pkt)
+    {
+        if (pkt.length < 1)
+            return;
+
+        reservoir &r = reservoir_for(direction, pkt.data[0]);
+        while (r.busy.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+
+        ++r.total;
+        group &g = group_for(r, static_cast<uint16_t>((std::min)(pkt.length, size_t{UINT16_MAX})));
+        const uint32_t seen = ++g.seen;
+        size_t slot = seen - 1;
+        if (seen > samples_per_group)
+            slot = next_random(r) % seen;
+        if (slot < samples_per_group)
+        {
+            auto &s = g.samples[slot];
+            s.length = static_cast<uint16_t>((std::min)(pkt.length, size_t{UINT16_MAX}));
+            s.stored = static_cast<uint16_t>((std::min)(pkt.length, max_sample_bytes));
+            std::memcpy(s.bytes.data(), pkt.data, s.stored);
+        }
+
+        r.busy.clear(std::memory_order_release);
+    }
+
+    // Packets seen for the opcode, sampled or not.
+    uint64_t seen(packet_direction direction, uint8_t opcode) const
+    {
+        const reservoir *r = reservoirs_[index(direction)][opcode].load(std::memory_order_acquire);
+        if (r == nullptr)
+            return 0;
+        while (r->busy.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+        const uint64_t total = r->total;
+        r->busy.clear(std::memory_order_release);
+        return total;
+    }
+
+    // Writes every sample held to path, replacing the previous corpus. The
+    // file is written beside it first and renamed into place, so a reader
+    // never sees half a corpus. Returns the number of samples written, or
+    // -1 if the file could not be written.
+    int flush(const std::string &path) const
+    {
+        std::vector<BYTE> out;
+        put(out, "DACP", 4);
+        put_int(out, corpus_version);
+        put_int(out, static_cast<uint16_t>(max_sample_bytes));
+
+        int written = 0;
+        for (size_t d = 0; d < reservoirs_.size(); ++d)
+        {
+            for (size_t opcode = 0; opcode < 256; ++opcode)
+            {
+                const reservoir *r = reservoirs_[d][opcode].load(std::memory_order_acquire);
+                if (r == nullptr)
+                    continue;
+
+                while (r->busy.test_and_set(std::memory_order_acquire))
+                {
+                    YieldProcessor();
+                }
+                for (const auto &g : r->groups)
+                {
+                    const size_t held = (std::min)(size_t{g.seen}, samples_per_group);
+                    for (size_t i = 0; i < held; ++i)
+                    {
+                        const auto &s = g.samples[i];
+                        out.push_back(static_cast<BYTE>(d));
+                        out.push_back(static_cast<BYTE>(opcode));
+                        put_int(out, g.seen);
+                        put_int(out, s.length);
+                        put_int(out, s.stored);
+                        put(out, s.bytes.data(), s.stored);
+                        ++written;
+                    }
+                }
+                r->busy.clear(std::memory_order_release);
+            }
+        }
+
+        const std::string partial = path + ".tmp";
+        {
+            std::ofstream file(partial, std::ios::binary | std::ios::trunc);
+            if (!file.is_open())
+                return -1;
+            file.write(reinterpret_cast<const char *>(out.data()), static_cast<std::streamsize>(out.size()));
+            if (!file)
+                return -1;
+        }
+
+        std::error_code error;
+        std::filesystem::rename(partial, path, error);
+        return error ? -1 : written;
+    }
+
+private:
+    struct sample_slot
+    {
+        uint16_t length = 0;
+        uint16_t stored = 0;
+        std::array<BYTE, max_sample_bytes> bytes{};
+    };
+
+    struct group
+    {
+        // 0 for the group shared by every length past the first few.
+        uint16_t length = 0;
+        uint32_t seen = 0;
+        std::array<sample_slot, samples_per_group> samples;
+    };
+
+    struct reservoir
+    {
+        mutable std::atomic_flag busy = ATOMIC_FLAG_INIT;
+        uint64_t random = 0x9E3779B97F4A7C15ull;
+        uint64_t total = 0;
+        std::array<group, length_groups + 1> groups;
+    };
+
+    std::array<std::array<std::atomic<reservoir *>, 256>, 2> reservoirs_{};
+
+    static size_t index(packet_direction direction)
+    {
+        return static_cast<size_t>(direction);
+    }
+
+    // Allocated the first time the opcode shows up, then never again.
+    reservoir &reservoir_for(packet_direction direction, uint8_t opcode)
+    {
+        auto &slot = reservoirs_[index(direction)][opcode];
+        if (reservoir *existing = slot.load(std::memory_order_acquire))
+            return *existing;
+
+        auto *created = new reservoir();
+        created->random ^= uint64_t{opcode} << 8 | index(direction);
+        reservoir *expected = nullptr;
+        if (slot.compare_exchange_strong(expected, created, std::memory_order_acq_rel))
+            return *created;
+        delete created;
+        return *expected;
+    }
+
+    static group &group_for(reservoir &r, uint16_t length)
+    {
+        for (size_t i = 0; i < length_groups; ++i)
+        {
+            auto &g = r.groups[i];
+            if (g.seen == 0)
+                g.length = length;
+            if (g.length == length)
+                return g;
+        }
+        return r.groups[length_groups];
+    }
+
+    // xorshift64: plenty for choosing which sample to replace.
+    static uint64_t next_random(reservoir &r)
+    {
+        r.random ^= r.random << 13;
+        r.random ^= r.random >> 7;
+        r.random ^= r.random << 17;
+        return r.random;
+    }
+
+    static void put(std::vector<BYTE> &out, const void *bytes, size_t count)
+    {
+        const auto *p = static_cast<const BYTE *>(bytes);
+        out.insert(out.end(), p, p + count);
+    }
+
+    template <typename T>
+    static void put_int(std::vector<BYTE> &out, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            out.push_back(static_cast<BYTE>(value >> (8 * i)));
+    }
+};
+
+inline packet_sampler unhandled_packets;
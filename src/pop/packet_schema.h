@@ -0,0 +1,394 @@
+#pragma once
+#include "pch.h"
+#include <string_view>
+#include <type_traits>
+#include "decode_result.h"
+#include "packet_structures.h"
+#include "packet_view.h"
+#include "packet_writer.h"
+#include "string_interner.h"
+
+// Declarative packet layouts. A layout is a list of field descriptors; the
+// same list drives decoding into a plain struct and encoding back through a
+// PacketWriter. Consecutive fixed-width fields are grouped into a run that is
+// length-checked once and then read without per-field checks. Only strings,
+// lists and flag-driven sections check at their own boundary. Decoding never
+// throws; failures come back as a decode_error.
+namespace schema
+{
+    template <typename T>
+    struct member_pointer;
+
+    template <typename Owner, typename Member>
+    struct member_pointer<Member Owner::*>
+    {
+        using owner = Owner;
+        using type = Member;
+    };
+
+    template <auto Member>
+    using member_t = typename member_pointer<decltype(Member)>::type;
+
+    // A fixed-width big-endian value stored into Member.
+    template <typename Wire, auto Member>
+    struct field
+    {
+        static constexpr bool is_fixed = true;
+        static constexpr size_t fixed_size = sizeof(Wire);
+
+        template <typename S>
+        static void read_unchecked(PacketView &view, S &out)
+        {
+            out.*Member = static_cast<member_t<Member>>(view.readUnchecked<Wire>());
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            writer.write<Wire>(static_cast<Wire>(in.*Member));
+        }
+    };
+
+    // A one byte flag stored into a bool Member. Only 1 means set, as the
+    // client reads it; any other value is false. Encodes as 1 or 0.
+    template <auto Member>
+    struct flag
+    {
+        static constexpr bool is_fixed = true;
+        static constexpr size_t fixed_size = 1;
+
+        template <typename S>
+        static void read_unchecked(PacketView &view, S &out)
+        {
+            out.*Member = view.readUnchecked<BYTE>() == 1;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            writer.write<BYTE>(in.*Member ? 1 : 0);
+        }
+    };
+
+    // Padding or bytes we do not care about. Encodes as zeros.
+    template <size_t N>
+    struct skip
+    {
+        static constexpr bool is_fixed = true;
+        static constexpr size_t fixed_size = N;
+
+        template <typename S>
+        static void read_unchecked(PacketView &view, S &)
+        {
+            view.skipUnchecked(N);
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &)
+        {
+            for (size_t i = 0; i < N; ++i)
+                writer.write<BYTE>(0);
+        }
+    };
+
+    // A string prefixed by a one byte length.
+    template <auto Member>
+    struct string8
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            if (view.remaining() < 1)
+                return decode_error::truncated;
+            const auto len = view.readUnchecked<BYTE>();
+            if (view.remaining() < len)
+                return decode_error::truncated;
+            out.*Member = view.readStringUnchecked(len);
+            return decode_error::none;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            writer.writeString8(in.*Member);
+        }
+    };
+
+    // A string8 stored as an interned name_id instead of a copy.
+    template <auto Member>
+    struct interned8
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            if (view.remaining() < 1)
+                return decode_error::truncated;
+            const auto len = view.readUnchecked<BYTE>();
+            if (view.remaining() < len)
+                return decode_error::truncated;
+            out.*Member = interned_names.intern(view.readStringUnchecked(len));
+            return decode_error::none;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            writer.writeString8(interned_names.view(in.*Member));
+        }
+    };
+
+    template <typename... Fields>
+    struct sequence;
+
+    template <>
+    struct sequence<>
+    {
+        static constexpr bool first_fixed = false;
+        static constexpr size_t leading_fixed = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &, S &)
+        {
+            return decode_error::none;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &, const S &)
+        {
+        }
+    };
+
+    template <typename First, typename... Rest>
+    struct sequence<First, Rest...>
+    {
+        static constexpr bool first_fixed = First::is_fixed;
+        static constexpr size_t leading_fixed = First::is_fixed ? First::fixed_size + sequence<Rest...>::leading_fixed : 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            if constexpr (First::is_fixed)
+            {
+                if (view.remaining() < leading_fixed)
+                    return decode_error::truncated;
+                return read_run(view, out);
+            }
+            else
+            {
+                if (const auto error = First::read(view, out); error != decode_error::none)
+                    return error;
+                return sequence<Rest...>::read(view, out);
+            }
+        }
+
+        // The caller has already checked that leading_fixed bytes remain.
+        template <typename S>
+        static decode_error read_run(PacketView &view, S &out)
+        {
+            First::read_unchecked(view, out);
+            if constexpr (sequence<Rest...>::first_fixed)
+                return sequence<Rest...>::read_run(view, out);
+            else
+                return sequence<Rest...>::read(view, out);
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            First::write(writer, in);
+            sequence<Rest...>::write(writer, in);
+        }
+    };
+
+    // A section that is only present when Predicate holds for what has been
+    // decoded so far, e.g. a bit in a flags byte.
+    template <typename Predicate, typename... Fields>
+    struct when
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            if (!Predicate::test(out))
+                return decode_error::none;
+            return sequence<Fields...>::read(view, out);
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            if (Predicate::test(in))
+                sequence<Fields...>::write(writer, in);
+        }
+    };
+
+    // Two alternative layouts for the rest of a section. Then and Else are
+    // sequence<...> lists.
+    template <typename Predicate, typename Then, typename Else>
+    struct branch
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            return Predicate::test(out) ? Then::read(view, out) : Else::read(view, out);
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            if (Predicate::test(in))
+                Then::write(writer, in);
+            else
+                Else::write(writer, in);
+        }
+    };
+
+    // Rejects the packet as an unknown variant unless Predicate holds for
+    // what has been decoded so far. Consumes no bytes.
+    template <typename Predicate>
+    struct expect
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &, S &out)
+        {
+            return Predicate::test(out) ? decode_error::none : decode_error::unknown_variant;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &, const S &)
+        {
+        }
+    };
+
+    template <typename Struct, typename... Fields>
+    struct layout : sequence<Fields...>
+    {
+        using type = Struct;
+    };
+
+    // A Count-prefixed run of elements decoded with Element (a layout) into
+    // the container at Member.
+    template <typename Count, auto Member, typename Element>
+    struct list
+    {
+        static constexpr bool is_fixed = false;
+        static constexpr size_t fixed_size = 0;
+
+        template <typename S>
+        static decode_error read(PacketView &view, S &out)
+        {
+            if (view.remaining() < sizeof(Count))
+                return decode_error::truncated;
+            const size_t count = view.readUnchecked<Count>();
+
+            auto &items = out.*Member;
+            items.clear();
+            items.reserve((std::min)(count, view.remaining() / (std::max)(Element::leading_fixed, static_cast<size_t>(1))));
+            for (size_t i = 0; i < count; ++i)
+            {
+                typename Element::type item{};
+                if (const auto error = Element::read(view, item); error != decode_error::none)
+                    return error;
+                items.push_back(std::move(item));
+            }
+            return decode_error::none;
+        }
+
+        template <typename S>
+        static void write(PacketWriter &writer, const S &in)
+        {
+            const auto &items = in.*Member;
+            writer.write<Count>(static_cast<Count>(items.size()));
+            for (const auto &item : items)
+                Element::write(writer, item);
+        }
+    };
+
+    template <BYTE Opcode, typename Struct, typename... Fields>
+    struct packet_layout : layout<Struct, Fields...>
+    {
+        static constexpr BYTE opcode = Opcode;
+    };
+
+    template <auto Member, auto Mask>
+    struct has_flags
+    {
+        template <typename S>
+        static bool test(const S &s)
+        {
+            return (s.*Member & Mask) != 0;
+        }
+    };
+
+    template <auto Member, auto Value>
+    struct equals
+    {
+        template <typename S>
+        static bool test(const S &s)
+        {
+            return s.*Member == Value;
+        }
+    };
+
+    template <auto Member, auto Value>
+    struct not_equals
+    {
+        template <typename S>
+        static bool test(const S &s)
+        {
+            return s.*Member != Value;
+        }
+    };
+
+    template <auto Member, auto Low, auto High>
+    struct in_range
+    {
+        template <typename S>
+        static bool test(const S &s)
+        {
+            return s.*Member >= Low && s.*Member <= High;
+        }
+    };
+
+    // Decodes a whole packet body (everything after the opcode byte) into
+    // an existing value.
+    template <typename Layout>
+    decode_error decode_into(const packet &pkt, typename Layout::type &out)
+    {
+        PacketView view(pkt);
+        if (view.remaining() < 1)
+            return decode_error::truncated;
+        view.skipUnchecked(1);
+        return Layout::read(view, out);
+    }
+
+    template <typename Layout>
+    decode_result<typename Layout::type> decode(const packet &pkt)
+    {
+        typename Layout::type out{};
+        if (const auto error = decode_into<Layout>(pkt, out); error != decode_error::none)
+            return error;
+        return out;
+    }
+
+    template <typename Layout>
+    void encode(PacketWriter &writer, const typename Layout::type &in)
+    {
+        writer.write<BYTE>(Layout::opcode);
+        Layout::write(writer, in);
+    }
+}
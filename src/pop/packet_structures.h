@@ -4,66 +4,124 @@
 #include <stdexcept>
 #include <iomanip>
 #include <sstream>
+#include "packet_pool.h"
+#include "packet_trace.h"
 
 // Assuming BYTE is defined as:
 using BYTE = unsigned char;
 
+// A captured packet. The bytes live in a pooled, reference-counted buffer and
+// are never modified after capture, so copies share the buffer instead of
+// duplicating it.
 class packet
 {
 public:
 	BYTE *data;
 	size_t length;
 
-	packet(BYTE *d, size_t len) : data(new BYTE[len]), length(len)
+	packet() : data(nullptr), length(0), buffer_(nullptr) {}
+
+	packet(const BYTE *d, size_t len) : length(len), buffer_(packet_buffers.acquire(len))
 	{
-		std::copy(d, d + len, data);
+		data = buffer_->bytes();
+		std::memcpy(data, d, len);
 	}
 
 	~packet()
 	{
-		delete[] data;
+		release();
+	}
+
+	packet(const packet &other) : data(other.data), length(other.length), buffer_(other.buffer_)
+	{
+		retain();
 	}
 
-	packet(const packet &other) : data(new BYTE[other.length]), length(other.length)
+	packet(packet &&other) noexcept : data(other.data), length(other.length), buffer_(other.buffer_)
 	{
-		std::copy(other.data, other.data + other.length, data);
+		other.data = nullptr;
+		other.length = 0;
+		other.buffer_ = nullptr;
 	}
 
 	packet &operator=(const packet &other)
 	{
 		if (this != &other)
 		{
-			delete[] data;
+			other.retain();
+			release();
+			data = other.data;
 			length = other.length;
-			data = new BYTE[length];
-			std::copy(other.data, other.data + other.length, data);
+			buffer_ = other.buffer_;
 		}
 		return *this;
 	}
 
-	BYTE operator[](size_t index) const
+	packet &operator=(packet &&other) noexcept
 	{
-		if (index >= length)
+		if (this != &other)
 		{
-			throw std::out_of_range("Index out of range");
+			release();
+			data = std::exchange(other.data, nullptr);
+			length = std::exchange(other.length, 0);
+			buffer_ = std::exchange(other.buffer_, nullptr);
 		}
-		return data[index];
+		return *this;
+	}
+
+	// Out-of-range reads yield 0 rather than throwing; decoders check the
+	// length up front through PacketView.
+	BYTE operator[](size_t index) const
+	{
+		return index < length ? data[index] : 0;
 	}
 
 	size_t size() const { return length; }
 
+	// Stamps the packet with its place in the global send/recv order and the
+	// time it was intercepted. Called by the pipeline at hook time only.
+	void stamp(uint64_t sequence, packet_direction direction)
+	{
+		buffer_->sequence = sequence;
+		buffer_->direction = static_cast<uint8_t>(direction);
+		buffer_->captured_ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	uint64_t sequence() const
+	{
+		return buffer_ != nullptr ? buffer_->sequence : 0;
+	}
+
+	packet_direction direction() const
+	{
+		return buffer_ != nullptr ? static_cast<packet_direction>(buffer_->direction) : packet_direction::send;
+	}
+
+	std::chrono::steady_clock::time_point captured_at() const
+	{
+		using clock = std::chrono::steady_clock;
+		return clock::time_point(clock::duration(buffer_ != nullptr ? buffer_->captured_ticks : 0));
+	}
+
 	void print_hex() const
 	{
-		std::ostringstream oss;
-		for (size_t i = 0; i < length; ++i)
-		{
-			oss << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << static_cast<int>(data[i]);
-			if (i < length - 1)
-			{
-				oss << " ";
-			}
-		}
-		std::cout << oss.str() << '\n';
+		packet_trace::print(data, length);
+	}
+
+private:
+	packet_buffer *buffer_;
+
+	void retain() const
+	{
+		if (buffer_ != nullptr)
+			buffer_->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void release()
+	{
+		if (buffer_ != nullptr && buffer_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			packet_buffers.release(buffer_);
+		buffer_ = nullptr;
 	}
 };
 
@@ -0,0 +1,185 @@
+#pragma once
+#include "pch.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+using BYTE = unsigned char;
+
+enum class packet_direction : uint8_t
+{
+    send,
+    recv,
+};
+
+// Hex encoding through a 256-entry table of digit pairs: one load and one
+// two-byte store per input byte, no stream formatting.
+namespace hex
+{
+    inline constexpr std::array<char, 512> table = []
+    {
+        constexpr char digits[] = "0123456789ABCDEF";
+        std::array<char, 512> t{};
+        for (size_t i = 0; i < 256; ++i)
+        {
+            t[i * 2] = digits[i >> 4];
+            t[i * 2 + 1] = digits[i & 0x0F];
+        }
+        return t;
+    }();
+
+    // Space-separated uppercase hex, e.g. "0C 00 1F". Writes 3 * length
+    // chars at most (the last byte has no trailing space) and returns the
+    // count written.
+    inline size_t encode(const BYTE *bytes, size_t length, char *out)
+    {
+        if (length == 0)
+            return 0;
+
+        char *p = out;
+        for (size_t i = 0; i < length; ++i)
+        {
+            std::memcpy(p, &table[bytes[i] * 2], 2);
+            p[2] = ' ';
+            p += 3;
+        }
+        return static_cast<size_t>(p - out) - 1;
+    }
+}
+
+// Console packet tracing that can stay on in production. Packets are
+// filtered by direction and opcode, then each (direction, opcode) pair draws
+// from its own token bucket so a flood of one opcode is counted instead of
+// printed. A traced line is encoded into a per-thread buffer and written
+// with a single fwrite; nothing is flushed per packet.
+class packet_trace
+{
+public:
+    static constexpr size_t max_traced_bytes = 512;
+
+    static void enable(packet_direction direction, BYTE opcode, bool enabled)
+    {
+        auto &word = filters_[index(direction)][opcode >> 6];
+        const uint64_t bit = uint64_t{1} << (opcode & 63);
+        if (enabled)
+            word.fetch_or(bit, std::memory_order_relaxed);
+        else
+            word.fetch_and(~bit, std::memory_order_relaxed);
+    }
+
+    static void enable_all(packet_direction direction, bool enabled)
+    {
+        for (auto &word : filters_[index(direction)])
+            word.store(enabled ? ~uint64_t{0} : 0, std::memory_order_relaxed);
+    }
+
+    static bool enabled(packet_direction direction, BYTE opcode)
+    {
+        const auto word = filters_[index(direction)][opcode >> 6].load(std::memory_order_relaxed);
+        return (word >> (opcode & 63)) & 1;
+    }
+
+    // Lines per second each opcode may print, and how many may burst.
+    static void set_rate_limit(uint32_t per_second, uint32_t burst)
+    {
+        rate_per_second_.store(per_second, std::memory_order_relaxed);
+        burst_.store(burst, std::memory_order_relaxed);
+    }
+
+    // Lines suppressed by the rate limit so far.
+    static uint64_t suppressed(packet_direction direction, BYTE opcode)
+    {
+        return buckets_[index(direction)][opcode].suppressed.load(std::memory_order_relaxed);
+    }
+
+    static void trace(packet_direction direction, const BYTE *bytes, size_t length)
+    {
+        if (length == 0 || !enabled(direction, bytes[0]) || !take_token(direction, bytes[0]))
+            return;
+        write_line(direction == packet_direction::send ? "-> " : "<- ", bytes, length);
+    }
+
+    // Prints unconditionally, bypassing filters and rate limits.
+    static void print(const BYTE *bytes, size_t length)
+    {
+        write_line("", bytes, length);
+    }
+
+private:
+    struct bucket
+    {
+        std::atomic_flag busy = ATOMIC_FLAG_INIT;
+        double tokens = -1;
+        std::chrono::steady_clock::time_point refilled;
+        std::atomic<uint64_t> suppressed{0};
+    };
+
+    static std::array<std::array<std::atomic<uint64_t>, 4>, 2> filters_;
+    static std::array<std::array<bucket, 256>, 2> buckets_;
+    static std::atomic<uint32_t> rate_per_second_;
+    static std::atomic<uint32_t> burst_;
+
+    static size_t index(packet_direction direction)
+    {
+        return static_cast<size_t>(direction);
+    }
+
+    static bool take_token(packet_direction direction, BYTE opcode)
+    {
+        auto &b = buckets_[index(direction)][opcode];
+        const auto now = std::chrono::steady_clock::now();
+        const double rate = rate_per_second_.load(std::memory_order_relaxed);
+        const double burst = burst_.load(std::memory_order_relaxed);
+
+        while (b.busy.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+
+        if (b.tokens < 0)
+        {
+            b.tokens = burst;
+        }
+        else
+        {
+            const std::chrono::duration<double> elapsed = now - b.refilled;
+            b.tokens = (std::min)(burst, b.tokens + elapsed.count() * rate);
+        }
+        b.refilled = now;
+
+        const bool allowed = b.tokens >= 1;
+        if (allowed)
+            b.tokens -= 1;
+        b.busy.clear(std::memory_order_release);
+
+        if (!allowed)
+            b.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return allowed;
+    }
+
+    static void write_line(std::string_view prefix, const BYTE *bytes, size_t length)
+    {
+        thread_local std::array<char, max_traced_bytes * 3 + 16> line;
+        std::memcpy(line.data(), prefix.data(), prefix.size());
+        size_t n = prefix.size();
+
+        const size_t shown = (std::min)(length, max_traced_bytes);
+        n += hex::encode(bytes, shown, line.data() + n);
+        if (shown < length)
+        {
+            std::memcpy(line.data() + n, " ..", 3);
+            n += 3;
+        }
+        line[n++] = '\n';
+        std::fwrite(line.data(), 1, n, stdout);
+    }
+};
+
+inline std::array<std::array<std::atomic<uint64_t>, 4>, 2> packet_trace::filters_{};
+inline std::array<std::array<packet_trace::bucket, 256>, 2> packet_trace::buckets_{};
+inline std::atomic<uint32_t> packet_trace::rate_per_second_{20};
+inline std::atomic<uint32_t> packet_trace::burst_{40};
@@ -0,0 +1,198 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include "decode_result.h"
+#include "packet_structures.h"
+
+// Big-endian loads straight out of the packet buffer. memcpy keeps the load
+// unaligned-safe and the compiler folds it together with the swap into a
+// single mov + bswap.
+template <typename T>
+T load_big_endian(const BYTE *src)
+{
+    if constexpr (sizeof(T) == 1)
+    {
+        return static_cast<T>(*src);
+    }
+    else if constexpr (sizeof(T) == 2)
+    {
+        uint16_t raw;
+        std::memcpy(&raw, src, sizeof(raw));
+        return static_cast<T>(_byteswap_ushort(raw));
+    }
+    else if constexpr (sizeof(T) == 4)
+    {
+        uint32_t raw;
+        std::memcpy(&raw, src, sizeof(raw));
+        return static_cast<T>(_byteswap_ulong(raw));
+    }
+    else
+    {
+        static_assert(sizeof(T) == 8, "Unsupported read width");
+        uint64_t raw;
+        std::memcpy(&raw, src, sizeof(raw));
+        return static_cast<T>(_byteswap_uint64(raw));
+    }
+}
+
+// Non-owning read cursor over a packet. It never copies: strings come back as
+// views into the packet buffer, so they are only valid while the packet is.
+// A view belongs to the thread that decodes with it and takes no locks.
+//
+// Reads never throw. Reading past the end returns a zero value and latches
+// decode_error::truncated, so a handler can decode a run of fields and check
+// ok() once at the end.
+class PacketView
+{
+private:
+    const BYTE *bodyData;
+    size_t length;
+    size_t position = 0;
+    decode_error failure = decode_error::none;
+
+    bool require(size_t count)
+    {
+        if (count <= length - position)
+            return true;
+        failure = decode_error::truncated;
+        position = length;
+        return false;
+    }
+
+public:
+    PacketView(const BYTE *data, size_t len) : bodyData(data), length(len) {}
+
+    explicit PacketView(const packet &pkt) : bodyData(pkt.data), length(pkt.size()) {}
+
+    explicit PacketView(std::span<const BYTE> bytes) : bodyData(bytes.data()), length(bytes.size()) {}
+
+    size_t getPosition() const
+    {
+        return position;
+    }
+
+    void setPosition(size_t newPos)
+    {
+        if (newPos > length)
+        {
+            failure = decode_error::truncated;
+            newPos = length;
+        }
+        position = newPos;
+    }
+
+    void skip(size_t count)
+    {
+        if (require(count))
+            position += count;
+    }
+
+    bool ok() const
+    {
+        return failure == decode_error::none;
+    }
+
+    decode_error error() const
+    {
+        return failure;
+    }
+
+    void fail(decode_error error)
+    {
+        if (failure == decode_error::none)
+            failure = error;
+    }
+
+    size_t remaining() const
+    {
+        return length - position;
+    }
+
+    bool canReadMore() const
+    {
+        return position < length;
+    }
+
+    void reset()
+    {
+        position = 0;
+        failure = decode_error::none;
+    }
+
+    unsigned char readByte()
+    {
+        if (!require(1))
+            return 0;
+        return bodyData[position++];
+    }
+
+    template <typename T>
+    T read()
+    {
+        static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "Read type must be integral or enum");
+        if (!require(sizeof(T)))
+            return T{};
+        T value = load_big_endian<T>(bodyData + position);
+        position += sizeof(T);
+        return value;
+    }
+
+    template <typename T>
+    decode_result<T> tryRead()
+    {
+        T value = read<T>();
+        if (!ok())
+            return failure;
+        return value;
+    }
+
+    // Unchecked variants for decoders that have already verified remaining()
+    // covers the whole run they are about to read.
+    template <typename T>
+    T readUnchecked()
+    {
+        T value = load_big_endian<T>(bodyData + position);
+        position += sizeof(T);
+        return value;
+    }
+
+    void skipUnchecked(size_t count)
+    {
+        position += count;
+    }
+
+    std::string_view readStringUnchecked(size_t len)
+    {
+        std::string_view str(reinterpret_cast<const char *>(bodyData + position), len);
+        position += len;
+        return str;
+    }
+
+    std::span<const BYTE> readBytes(size_t len)
+    {
+        if (!require(len))
+            return {};
+        std::span<const BYTE> bytes(bodyData + position, len);
+        position += len;
+        return bytes;
+    }
+
+    std::string_view readString(size_t len)
+    {
+        if (!require(len))
+            return {};
+        std::string_view str(reinterpret_cast<const char *>(bodyData + position), len);
+        position += len;
+        return str;
+    }
+
+    std::string_view readString8()
+    {
+        auto len = readByte();
+        return readString(len);
+    }
+};
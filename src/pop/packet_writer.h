@@ -1,104 +1,241 @@
 #pragma once
 #include "pch.h"
+#include <iostream>
+#include <span>
+#include <string_view>
+#include "decode_result.h"
 #include "network_functions.h"
+#include "packet_trace.h"
 
+// Builds an outgoing packet. Packets up to inline_capacity bytes (nearly
+// everything we send) never touch the heap. A writer is owned by the thread
+// building the packet and takes no locks.
+//
+// Writes never throw. Like PacketView, a value that cannot be encoded
+// latches an error for the caller to check with ok() once at the end, and a
+// writer that has failed refuses to send.
 class PacketWriter
 {
-private:
-    std::vector<BYTE> data;
-    mutable std::shared_mutex mutex;
-
 public:
+    static constexpr size_t inline_capacity = 64;
+
     PacketWriter() = default;
 
-    PacketWriter(const PacketWriter& other)
+    PacketWriter(const PacketWriter &other) : failure(other.failure)
     {
-        std::shared_lock<std::shared_mutex> lock(other.mutex);
-        data = other.data;
+        append(other.buffer, other.size);
     }
 
-    PacketWriter& operator=(const PacketWriter& other)
+    PacketWriter(PacketWriter &&other) noexcept : failure(other.failure)
+    {
+        if (other.spill)
+        {
+            spill = std::move(other.spill);
+            buffer = spill.get();
+            capacity = other.capacity;
+            size = other.size;
+        }
+        else
+        {
+            append(other.buffer, other.size);
+        }
+        other.reset();
+    }
+
+    PacketWriter &operator=(const PacketWriter &other)
     {
         if (this != &other)
         {
-            std::unique_lock<std::shared_mutex> lhs_lock(mutex, std::defer_lock);
-            std::shared_lock<std::shared_mutex> rhs_lock(other.mutex, std::defer_lock);
-            std::lock(lhs_lock, rhs_lock);
-            data = other.data;
+            size = 0;
+            append(other.buffer, other.size);
+            failure = other.failure;
+        }
+        return *this;
+    }
+
+    PacketWriter &operator=(PacketWriter &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (other.spill)
+            {
+                spill = std::move(other.spill);
+                buffer = spill.get();
+                capacity = other.capacity;
+                size = other.size;
+            }
+            else
+            {
+                size = 0;
+                append(other.buffer, other.size);
+            }
+            failure = other.failure;
+            other.reset();
         }
         return *this;
     }
 
     template <typename T>
-    void write(const T& value)
+    void write(const T &value)
     {
         static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "Write type must be arithmetic or enum");
-        std::unique_lock<std::shared_mutex> lock(mutex);
-        size_t typeLength = sizeof(T);
-        BYTE valueBytes[sizeof(T)];
+        constexpr size_t typeLength = sizeof(T);
+        reserve(typeLength);
 
-        // Convert value to bytes in network byte order (big-endian)
+        // Network byte order (big-endian)
+        const auto raw = [&value]
+        {
+            if constexpr (std::is_enum_v<T>)
+                return static_cast<std::underlying_type_t<T>>(value);
+            else
+                return value;
+        }();
         for (size_t i = 0; i < typeLength; ++i)
         {
-            valueBytes[i] = static_cast<BYTE>((value >> (8 * (typeLength - 1 - i))) & 0xFF);
+            buffer[size + i] = static_cast<BYTE>((raw >> (8 * (typeLength - 1 - i))) & 0xFF);
         }
-
-        // Append the bytes to the packet data
-        data.insert(data.end(), valueBytes, valueBytes + typeLength);
+        size += typeLength;
     }
 
-    void writeBytes(const std::vector<BYTE>& bytes)
+    void writeBytes(std::span<const BYTE> bytes)
     {
-        std::unique_lock<std::shared_mutex> lock(mutex);
-        data.insert(data.end(), bytes.begin(), bytes.end());
+        append(bytes.data(), bytes.size());
     }
 
-    void writeString(const std::string& str)
+    void writeString(std::string_view str)
     {
-        writeBytes(std::vector<BYTE>(str.begin(), str.end()));
+        append(reinterpret_cast<const BYTE *>(str.data()), str.size());
     }
 
-    void writeString8(const std::string& str)
+    // A string over 255 bytes does not fit its length byte: nothing is
+    // written and the writer latches decode_error::too_long.
+    void writeString8(std::string_view str)
     {
         if (str.length() > 255)
-            throw std::out_of_range("String length exceeds maximum for writeString8");
+        {
+            fail(decode_error::too_long);
+            return;
+        }
         write<BYTE>(static_cast<BYTE>(str.length()));
         writeString(str);
     }
 
-    void sendToServer()
+    bool ok() const
+    {
+        return failure == decode_error::none;
+    }
+
+    decode_error error() const
+    {
+        return failure;
+    }
+
+    void fail(decode_error error)
+    {
+        if (failure == decode_error::none)
+            failure = error;
+    }
+
+    // Sends a copy of the packet; the writer can be reused afterwards.
+    void sendToServer() const &
     {
-        std::shared_lock<std::shared_mutex> lock(mutex);
-        if (!data.empty())
+        if (sendable())
         {
-            printBytesHex();
-            game_function::send_to_server(data.data(), static_cast<int>(data.size()));
+            logIfEnabled();
+            game_function::send_to_server(buffer, static_cast<int>(size));
         }
     }
 
-    void printBytesHex() const
+    // Hands the writer's own buffer to the transport without copying it. The
+    // client encrypts the buffer in place, so the writer is consumed.
+    void sendToServer() &&
     {
-        std::shared_lock<std::shared_mutex> lock(mutex);
-        for (size_t i = 0; i < data.size(); ++i)
+        if (sendable())
         {
-            std::cout << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << static_cast<int>(data[i]);
-            if (i < data.size() - 1)
-            {
-                std::cout << " ";
-            }
+            logIfEnabled();
+            game_function::send_buffer_to_server(buffer, static_cast<int>(size));
         }
-        std::cout << std::endl;
+        reset();
+    }
+
+    void printBytesHex() const
+    {
+        packet_trace::print(buffer, size);
+    }
+
+    static void setLogging(bool enabled)
+    {
+        logging.store(enabled, std::memory_order_relaxed);
     }
 
     void reset()
     {
-        std::unique_lock<std::shared_mutex> lock(mutex);
-        data.clear();
+        spill.reset();
+        buffer = storage;
+        capacity = inline_capacity;
+        size = 0;
+        failure = decode_error::none;
+    }
+
+    const BYTE *data() const
+    {
+        return buffer;
     }
 
     size_t getSize() const
     {
-        std::shared_lock<std::shared_mutex> lock(mutex);
-        return data.size();
+        return size;
+    }
+
+private:
+    BYTE storage[inline_capacity];
+    std::unique_ptr<BYTE[]> spill;
+    BYTE *buffer = storage;
+    size_t capacity = inline_capacity;
+    size_t size = 0;
+    decode_error failure = decode_error::none;
+
+    inline static std::atomic<bool> logging{false};
+
+    void reserve(size_t extra)
+    {
+        if (size + extra <= capacity)
+            return;
+
+        size_t grown = capacity * 2;
+        while (grown < size + extra)
+            grown *= 2;
+
+        auto larger = std::make_unique<BYTE[]>(grown);
+        std::memcpy(larger.get(), buffer, size);
+        spill = std::move(larger);
+        buffer = spill.get();
+        capacity = grown;
+    }
+
+    void append(const BYTE *bytes, size_t count)
+    {
+        reserve(count);
+        std::memcpy(buffer + size, bytes, count);
+        size += count;
+    }
+
+    bool sendable() const
+    {
+        if (size == 0)
+            return false;
+        if (failure == decode_error::none)
+            return true;
+        std::cout << "Not sending 0x" << std::hex << std::uppercase << static_cast<int>(buffer[0]) << std::dec
+                  << ": " << to_string(failure) << std::endl;
+        return false;
+    }
+
+    void logIfEnabled() const
+    {
+        if (logging.load(std::memory_order_relaxed))
+        {
+            packet_trace::trace(packet_direction::send, buffer, size);
+        }
     }
-};
\ No newline at end of file
+};
@@ -2,6 +2,7 @@
 #include "pch.h"
 #include "structures.h"
 #include "animations.h"
+#include "string_interner.h"
 
 struct Player
 {
@@ -11,7 +12,8 @@ struct Player
 	USHORT HeadColor, BootColor, Acc1Color, Acc2Color, OvercoatColor, SkinColor;
 	USHORT Acc1, Acc2, Acc3, Overcoat;
 	BYTE RestCloak, HideBool, FaceShape, Unknown, Unknown2;
-	std::string Name, GroupName;
+	name_id Name;
+	std::string GroupName;
 	BYTE NameTagStyle;
 	bool Hostile;
 	__time64_t KelbLastSeen;
@@ -20,7 +22,7 @@ struct Player
 	Player() : Serial(0), Head(0), Form(0), Body(0), Arms(0), Boots(0), Armor(0), Shield(0), Weapon(0),
 			   HeadColor(0), BootColor(0), Acc1Color(0), Acc2Color(0), OvercoatColor(0), SkinColor(0),
 			   Acc1(0), Acc2(0), Acc3(0), Overcoat(0), RestCloak(0), HideBool(0), FaceShape(0), Unknown(0), Unknown2(0),
-			   NameTagStyle(0), Hostile(false)
+			   Name(no_name), NameTagStyle(0), Hostile(false)
 	{
 	}
 
@@ -52,7 +54,7 @@ struct Player
 	BYTE GetFaceShape() const { return FaceShape; }
 	BYTE GetUnknown() const { return Unknown; }
 	BYTE GetUnknown2() const { return Unknown2; }
-	std::string GetName() const { return Name; }
+	std::string GetName() const { return std::string(interned_names.view(Name)); }
 	std::string GetGroupName() const { return GroupName; }
 	BYTE GetNameTagStyle() const { return NameTagStyle; }
 
@@ -92,7 +94,7 @@ struct Player
 	void SetFaceShape(BYTE faceShape) { FaceShape = faceShape; }
 	void SetUnknown(BYTE unknown) { Unknown = unknown; }
 	void SetUnknown2(BYTE unknown2) { Unknown2 = unknown2; }
-	void SetName(const std::string &name) { Name = name; }
+	void SetName(std::string_view name) { Name = interned_names.intern(name); }
 	void SetGroupName(const std::string &groupName) { GroupName = groupName; }
 	void SetNameTagStyle(BYTE nameTagStyle) { NameTagStyle = nameTagStyle; }
 
@@ -152,7 +154,7 @@ struct Player
 
 	bool IsHostile(const std::vector<std::string> &hostileList) const
 	{
-		return std::find(hostileList.begin(), hostileList.end(), this->Name) != hostileList.end();
+		return std::find(hostileList.begin(), hostileList.end(), interned_names.view(Name)) != hostileList.end();
 	}
 
 	void PrintData() const
@@ -187,7 +189,7 @@ struct Player
 		std::cout << std::setw(width) << "FaceShape" << std::setw(width) << static_cast<int>(FaceShape) << '\n';
 		std::cout << std::setw(width) << "Unknown" << std::setw(width) << static_cast<int>(Unknown) << '\n';
 		std::cout << std::setw(width) << "Unknown2" << std::setw(width) << static_cast<int>(Unknown2) << '\n';
-		std::cout << std::setw(width) << "Name" << std::setw(width) << Name << '\n';
+		std::cout << std::setw(width) << "Name" << std::setw(width) << interned_names.view(Name) << '\n';
 		std::cout << std::setw(width) << "GroupName" << std::setw(width) << GroupName << '\n';
 		std::cout << std::setw(width) << "NameTagStyle" << std::setw(width) << static_cast<int>(NameTagStyle) << '\n';
 		std::cout << std::string(30, '-') << '\n';
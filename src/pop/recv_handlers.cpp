@@ -1,133 +1,106 @@
 #include "pch.h"
 #include "gamestate_manager.h"
-#include "packet_reader.h"
+#include "packet_layouts.h"
 #include "packet_structures.h"
+#include "sprite_columns.h"
 #include "structures.h"
-#include <regex>
 #include "spell.h"
 #include "spell_manager.h"
 
-extern void recv_handle_packet_x07(const packet &packet)
+// The receive handlers and the decoders they inline are built without C++
+// exceptions (/EHs-c- and _HAS_EXCEPTIONS=0, see pop.vcxproj): a malformed
+// packet is a decode_error, never an unwind. Nothing here may rely on
+// catching one, and nothing here may pull in an STL facility that throws
+// on its own input (<regex>, std::stoi).
+#if defined(_MSC_VER) && defined(_CPPUNWIND)
+#error recv_handlers.cpp must be compiled with exception handling disabled
+#endif
+
+namespace
 {
-    try
+    // Skips a run of decimal digits; false when there were none.
+    bool skip_digits(std::string_view &text)
     {
-        PacketReader msg(packet);
-        msg.readByte();
+        size_t n = 0;
+        while (n < text.size() && text[n] >= '0' && text[n] <= '9')
+            ++n;
+        text.remove_prefix(n);
+        return n != 0;
+    }
 
-        auto count = msg.read<uint16_t>();
-        for (uint16_t i = 0; i < count; ++i)
+    // "Name (Lev:3/100)" -> "Name". Names without the suffix come back as is.
+    std::string_view strip_spell_level(std::string_view name)
+    {
+        constexpr std::string_view marker = " (Lev:";
+        for (size_t at = name.find(marker); at != std::string_view::npos; at = name.find(marker, at + 1))
         {
-            auto xCoord = msg.read<uint16_t>();
-            auto yCoord = msg.read<uint16_t>();
-            auto serial = msg.read<uint32_t>();
-            auto image = msg.read<uint16_t>();
-            auto color = msg.read<uint8_t>();
-            auto display = msg.read<uint16_t>();
-
-            std::shared_ptr<Sprite> s = std::make_shared<Sprite>(xCoord, yCoord, serial, image);
-
-            if (image >= 0x4000 && image <= 0x8000)
-            {
-                auto spriteOffset = image - 0x4000;
-                auto unknown1 = msg.read<uint8_t>();
-                auto num4 = msg.read<uint8_t>();
-                auto unknown2 = msg.read<uint8_t>();
-                auto type = msg.read<uint8_t>();
-
-                if (type == 0x2)
-                {
-                    // NPC
-                    auto name = msg.readString8();
-                }
-                else
-                {
-                    // MONSTER
-                }
-            }
-            else if (image >= 0x8000)
-            {
-                // Item
-                auto sprite = image - 0x8000;
-            }
+            std::string_view rest = name.substr(at + marker.size());
+            if (!skip_digits(rest) || rest.empty() || rest.front() != '/')
+                continue;
+            rest.remove_prefix(1);
+            if (skip_digits(rest) && !rest.empty() && rest.front() == ')')
+                return name.substr(0, at);
         }
-    }
-    catch (const std::exception &e)
-    {
-        std::cerr << "Exception caught in recv_handle_packet_x07: " << e.what() << '\n';
-    }
-    catch (...)
-    {
-        std::cerr << "Unknown exception caught in recv_handle_packet_x07." << '\n';
+        return name;
     }
 }
 
-extern void recv_handle_packet_x3A(const packet &packet)
+extern decode_error recv_handle_packet_x07(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    // Reused across packets so a map load does not reallocate the columns.
+    thread_local SpriteColumns sprites;
+    if (const auto error = sprite_list_decoder::decode(packet, sprites); error != decode_error::none)
+        return error;
+
+    return decode_error::none;
+}
 
-    USHORT icon = msg.read<unsigned short>();
-    byte color = msg.readByte();
+extern decode_error recv_handle_packet_x3A(const packet &packet)
+{
+    auto update = schema::decode<layouts::spell_bar>(packet);
+    if (!update)
+        return update.error();
 
-    if (color > 0)
+    if (update->Color > 0)
     {
-        game_state.spellbar.AddSpellIcon(icon, color);
+        game_state.spellbar.AddSpellIcon(update->Icon, update->Color);
     }
     else
     {
-        game_state.spellbar.RemoveSpellIcon(icon);
+        game_state.spellbar.RemoveSpellIcon(update->Icon);
     }
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x39(const packet &packet)
+extern decode_error recv_handle_packet_x39(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
-
-    Legend legendData;
-    legendData.Nation = msg.readByte();
-    legendData.GuildRank = msg.readString(msg.readByte());
-    legendData.Title = msg.readString(msg.readByte());
-    legendData.GroupList = msg.readString(msg.readByte());
-    msg.readByte(); // Skip the byte that's always 1
-    legendData.Notes = msg.readString(msg.readByte());
-    legendData.Path = msg.readByte();
-    legendData.Medenian = msg.readByte() == 1;
-    legendData.Master = msg.readByte() == 1;
-    legendData.Class = msg.readString(msg.readByte());
-    legendData.Guild = msg.readString(msg.readByte());
-
-    auto marksCount = msg.readByte();
-    for (int i = 0; i < marksCount; ++i)
-    {
-        LegendMark mark;
-        mark.Icon = msg.readByte();
-        mark.TextColor = msg.readByte();
-        mark.MarkID = msg.readString(msg.readByte());
-        mark.Mark = msg.readString(msg.readByte());
-        legendData.LegendMarks.push_back(mark);
-    }
+    auto legendData = schema::decode<layouts::legend>(packet);
+    if (!legendData)
+        return legendData.error();
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x04(const packet &packet)
+extern decode_error recv_handle_packet_x04(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
-    game_state.update_player_location(Location(
-        msg.read<unsigned short>(),
-        msg.read<unsigned short>()));
+    auto location = schema::decode<layouts::map_location>(packet);
+    if (!location)
+        return location.error();
+
+    game_state.update_player_location(*location);
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x0B(const packet &packet)
+extern decode_error recv_handle_packet_x0B(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto walk = schema::decode<layouts::player_walk>(packet);
+    if (!walk)
+        return walk.error();
 
-    const auto direction = static_cast<Direction>(msg.readByte());
-
-    auto oldX = msg.read<unsigned short>();
-    auto oldY = msg.read<unsigned short>();
-    auto newX = oldX, newY = oldY;
+    const auto direction = walk->Facing;
+    auto newX = walk->X, newY = walk->Y;
 
     switch (direction)
     {
@@ -148,19 +121,16 @@ extern void recv_handle_packet_x0B(const packet &packet)
 
     game_state.update_player_direction(direction);
     game_state.update_player_location(Location(newX, newY));
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x0C(const packet &packet)
+extern void recv_on_entity_walk(const EntityWalk &walk)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    unsigned int id = walk.Serial;
+    auto newX = walk.X, newY = walk.Y;
 
-    unsigned int id = msg.read<unsigned int>();
-    auto oldX = msg.read<unsigned short>();
-    auto oldY = msg.read<unsigned short>();
-    auto newX = oldX, newY = oldY;
-
-    auto const direction = static_cast<Direction>(msg.readByte());
+    auto const direction = walk.Facing;
 
     switch (direction)
     {
@@ -199,182 +169,108 @@ extern void recv_handle_packet_x0C(const packet &packet)
     }
 }
 
-extern void recv_handle_packet_x08(const packet &pkt)
+extern decode_error recv_handle_packet_x08(const packet &pkt)
 {
-    PacketReader packet(pkt);
-
-    if (packet.readByte() == 0x08)
-    {
-        char bitmask = packet.read<char>();
+    auto newStats = schema::decode<layouts::stats>(pkt);
+    if (!newStats)
+        return newStats.error();
 
-        StatsSnapshot newStats{};
-        newStats.BitMask = bitmask;
+    game_state.statistics_observer.updateStats(*newStats);
 
-        if (bitmask & 0x20)
-        {
-            packet.setPosition(packet.getPosition() + 3);
-            newStats.Level = packet.read<char>();
-            newStats.Ability = packet.read<char>();
-            newStats.MaximumHP = packet.read<unsigned int>();
-            newStats.MaximumMP = packet.read<unsigned int>();
-            newStats.Str = packet.read<char>();
-            newStats.Int = packet.read<char>();
-            newStats.Wis = packet.read<char>();
-            newStats.Con = packet.read<char>();
-            newStats.Dex = packet.read<char>();
-            newStats.availablePoints = packet.read<bool>();
-            newStats.AvailablePoints = packet.read<char>();
-            newStats.MaximumWeight = packet.read<unsigned short>();
-            newStats.CurrentWeight = packet.read<unsigned short>();
-            packet.setPosition(packet.getPosition() + 4);
-        }
-        if (bitmask & 0x10)
-        {
-            newStats.CurrentHP = packet.read<unsigned int>();
-            newStats.CurrentMP = packet.read<unsigned int>();
-        }
-        if (bitmask & 0x08)
-        {
-            newStats.Experience = packet.read<unsigned int>();
-            newStats.ToNextLevel = packet.read<unsigned int>();
-            newStats.AbilityExp = packet.read<unsigned int>();
-            newStats.ToNextAbility = packet.read<unsigned int>();
-            packet.setPosition(packet.getPosition() + 4);
-            newStats.Gold = packet.read<unsigned int>();
-        }
-        if (bitmask & 0x04)
-        {
-            newStats.BitMask = packet.read<unsigned short>();
-            packet.setPosition(packet.getPosition() + 1);
-            newStats.AttackElement2 = packet.read<char>();
-            newStats.DefenseElement2 = packet.read<char>();
-            newStats.MailAndParcel = packet.read<char>();
-            newStats.AttackElement = static_cast<Elements>(packet.read<char>());
-            newStats.DefenseElement = static_cast<Elements>(packet.read<char>());
-            newStats.MagicResistance = packet.read<char>();
-            packet.setPosition(packet.getPosition() + 1);
-            newStats.ArmorClass = static_cast<signed char>(packet.read<char>());
-            newStats.Damage = packet.read<char>();
-            newStats.Hit = packet.read<char>();
-        }
-
-        game_state.statistics_observer.updateStats(newStats);
-    }
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x29(const packet &pkt)
+extern bool recv_is_self_x0C(const packet &packet)
 {
-    PacketReader msg(pkt);
-    msg.readByte();
-
-    int fromId = 0;
-    int targetId = 0;
-    int fromEffect = 0;
-    int targetEffect = 0;
-    int delay = 0;
-    int x = 0;
-    int y = 0;
-
-    targetId = msg.read<unsigned int>();
+    return packet.size() >= 5 && load_big_endian<unsigned int>(packet.data + 1) == game_state.get_serial();
+}
 
-    if (targetId != 0)
-    {
-        fromId = msg.read<unsigned int>();
-        targetEffect = msg.read<unsigned short>();
-        fromEffect = msg.read<unsigned short>();
-        delay = msg.read<unsigned short>();
-    }
-    else
-    {
-        targetEffect = msg.read<unsigned short>();
-        delay = msg.read<unsigned short>();
-        x = msg.read<unsigned short>();
-        y = msg.read<unsigned short>();
-        msg.readByte();
-    }
+extern decode_error recv_handle_packet_x29(const packet &pkt)
+{
+    auto event = schema::decode<layouts::animation>(pkt);
+    if (!event)
+        return event.error();
 
     Animation
         animation(
-            fromId,
-            targetId,
-            fromEffect,
-            targetEffect,
-            delay,
-            x,
-            y);
+            event->FromId,
+            event->TargetId,
+            event->FromEffect,
+            event->TargetEffect,
+            event->Delay,
+            event->X,
+            event->Y);
 
     game_state.animations_manager.addAnimation(animation);
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x0E(const packet &packet)
+extern decode_error recv_handle_packet_x0E(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto removal = schema::decode<layouts::entity_removal>(packet);
+    if (!removal)
+        return removal.error();
 
-    const unsigned int id = msg.read<unsigned int>();
+    if (!game_state.player_manager.DeleteBySerial(removal->Serial))
+        game_state.sprite_manager.DeleteBySerial(removal->Serial);
 
-    if (!game_state.player_manager.DeleteBySerial(id))
-        game_state.sprite_manager.DeleteBySerial(id);
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x17(const packet &packet)
+extern decode_error recv_handle_packet_x17(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto update = schema::decode<layouts::add_spell>(packet);
+    if (!update)
+        return update.error();
 
-    spell s;
-    s.slot = msg.readByte();
-    s.icon = msg.read<unsigned short>();
-    s.type = msg.readByte();
-    s.name = msg.readString(msg.readByte());
-    s.prompt = msg.readString(msg.readByte());
-    s.castLines = msg.readByte();
-
-    std::regex spellNameRegex("(.*?)( \\(Lev:)(\\d+)(\\/)(\\d+)(\\))");
-    std::smatch match;
-    if (std::regex_search(s.name, match, spellNameRegex) && match.size() > 5)
-    {
-        s.name = match[1].str();
-    }
+    const std::string_view name = strip_spell_level(update->Name);
 
+    spell s;
+    s.name = interned_names.intern(name);
+    s.slot = update->Slot;
+    s.icon = update->Icon;
+    s.type = update->Type;
+    s.prompt = update->Prompt;
+    s.castLines = update->CastLines;
     game_state.spells_manager.add_spell(s);
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x18(const packet &packet)
+extern decode_error recv_handle_packet_x18(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto removal = schema::decode<layouts::remove_spell>(packet);
+    if (!removal)
+        return removal.error();
 
-    int slot = msg.readByte();
+    int slot = removal->Slot;
     if (slot > 0)
     {
         game_state.spells_manager.remove_spell(slot);
     }
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x10(const packet &packet)
+extern decode_error recv_handle_packet_x10(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto removal = schema::decode<layouts::remove_item>(packet);
+    if (!removal)
+        return removal.error();
 
-    int slot = msg.readByte();
-    game_state.inventory_manager.RemoveItem(slot);
+    game_state.inventory_manager.RemoveItem(removal->Slot);
+
+    return decode_error::none;
 }
 
-extern void recv_handle_packet_x0F(const packet &packet)
+extern decode_error recv_handle_packet_x0F(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
-
-    Item item;
-    item.InventorySlot = msg.readByte();
-    item.Icon = msg.read<unsigned short>();
-    item.IconPal = msg.readByte();
-    item.Name = msg.readString8();
-    item.Amount = msg.read<unsigned int>();
-    item.Stackable = msg.readByte();
-    item.MaximumDurability = msg.read<unsigned int>();
-    item.CurrentDurability = msg.read<unsigned int>();
-
-    game_state.inventory_manager.AddItem(item);
+    auto item = schema::decode<layouts::add_item>(packet);
+    if (!item)
+        return item.error();
+
+    game_state.inventory_manager.AddItem(*item);
+
+    return decode_error::none;
 }
@@ -3,6 +3,7 @@
 #include "script_manager.h"
 #include "gamestate_manager.h"
 #include "network_functions.h"
+#include "task_pool.h"
 #include "ui_manager.h"
 
 ScriptManager script_manager;
@@ -11,6 +12,9 @@ ScriptManager::ScriptManager() {
     L = luaL_newstate();
     luaL_openlibs(L);
     RegisterFunctions();
+    scriptLane.set_schedule([this]() {
+        scheduler.post_untraced([this]() { DrainPacketCallbacks(); });
+    });
 }
 
 ScriptManager::~ScriptManager() {
@@ -18,6 +22,7 @@ ScriptManager::~ScriptManager() {
 }
 
 void ScriptManager::LoadScript(const std::string& scriptPath) {
+    std::lock_guard<std::recursive_mutex> lock(luaMutex);
     if (luaL_dofile(L, scriptPath.c_str()) != LUA_OK) {
         const char* error = lua_tostring(L, -1);
         std::cerr << "Error loading script: " << scriptPath << " with error: " << error << std::endl;
@@ -40,6 +45,7 @@ void ScriptManager::SubscribeToEvent(const std::string& eventName, lua_State* L,
 }
 
 void ScriptManager::TriggerEvent(const std::string& eventName) {
+    std::lock_guard<std::recursive_mutex> lock(luaMutex);
     std::cout << "Triggering event: " << eventName << std::endl;
     auto& callbacks = eventCallbacks[eventName];
 
@@ -51,9 +57,65 @@ void ScriptManager::TriggerEvent(const std::string& eventName) {
         }
     }
 }
+
+subscription_id ScriptManager::SubscribeToPacket(packet_direction direction, uint8_t opcode, int priority, lua_State* L, int index) {
+    std::lock_guard<std::recursive_mutex> lock(luaMutex);
+    lua_pushvalue(L, index);
+    auto ref = std::make_shared<int>(luaL_ref(L, LUA_REGISTRYINDEX));
+
+    // Runs on a dispatch lane: hand the packet to the script lane and let
+    // the chain carry on. A script callback cannot stop the chain.
+    const subscription_id id = PacketHandlerRegistry::subscribe_chain(direction, opcode, priority, [this, ref](const packet& pkt) {
+        scriptLane.push(queued_packet{ref, pkt, latency_trace::current()});
+        return chain_result::next;
+    });
+    packetCallbacks[id] = ref;
+    return id;
+}
+
+void ScriptManager::DrainPacketCallbacks() {
+    do {
+        scriptLane.drain([this](queued_packet& queued) {
+            RunPacketCallback(queued);
+            queued = queued_packet{};
+        });
+    } while (scriptLane.release());
+}
+
+// The callback gets the packet bytes.
+void ScriptManager::RunPacketCallback(const queued_packet& queued) {
+    std::lock_guard<std::recursive_mutex> lock(luaMutex);
+    if (*queued.ref == LUA_NOREF)
+        return;
+
+    // Whatever the script sends is a reaction to the packet it was given.
+    latency_trace::cause_scope cause(queued.cause);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, *queued.ref);
+    lua_pushlstring(L, reinterpret_cast<const char*>(queued.pkt.data), queued.pkt.length);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        std::cerr << "Error in packet callback: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+    }
+}
+
+void ScriptManager::UnsubscribeFromPacket(subscription_id id) {
+    PacketHandlerRegistry::unsubscribe_chain(id);
+
+    std::lock_guard<std::recursive_mutex> lock(luaMutex);
+    const auto it = packetCallbacks.find(id);
+    if (it == packetCallbacks.end())
+        return;
+    luaL_unref(L, LUA_REGISTRYINDEX, *it->second);
+    *it->second = LUA_NOREF;
+    packetCallbacks.erase(it);
+}
+
 void ScriptManager::RegisterFunctions() {
     lua_register(L, "BotFunction", Lua_BotFunction);
     lua_register(L, "SubscribeToEvent", Lua_SubscribeToEvent); 
+    lua_register(L, "SubscribeToPacket", Lua_SubscribeToPacket);
+    lua_register(L, "UnsubscribeFromPacket", Lua_UnsubscribeFromPacket);
 }
 
 int ScriptManager::Lua_SubscribeToEvent(lua_State* L) {
@@ -86,4 +148,43 @@ int ScriptManager::Lua_SubscribeToEvent(lua_State* L) {
 
 int ScriptManager::Lua_BotFunction(lua_State* L) {
     return 0;
-}
\ No newline at end of file
+}
+
+// SubscribeToPacket("recv", 0x29, priority, function(bytes) ... end)
+// The callback runs on the script lane, after the packet has been handled.
+int ScriptManager::Lua_SubscribeToPacket(lua_State* L) {
+    if (lua_gettop(L) != 4 || !lua_isstring(L, 1) || !lua_isnumber(L, 2) || !lua_isnumber(L, 3) || !lua_isfunction(L, 4)) {
+        lua_pushstring(L, "Usage: SubscribeToPacket(\"send\"|\"recv\", opcode, priority, callback)");
+        lua_error(L);
+        return 0;
+    }
+
+    // Compared as a C string: lua_error longjmps, so nothing with a
+    // destructor may be live when it is raised.
+    const char* direction = lua_tostring(L, 1);
+    const bool send = std::strcmp(direction, "send") == 0;
+    if (!send && std::strcmp(direction, "recv") != 0) {
+        lua_pushstring(L, "First argument must be \"send\" or \"recv\"");
+        lua_error(L);
+        return 0;
+    }
+
+    const subscription_id id = script_manager.SubscribeToPacket(
+        send ? packet_direction::send : packet_direction::recv,
+        static_cast<uint8_t>(lua_tointeger(L, 2)),
+        static_cast<int>(lua_tointeger(L, 3)),
+        L, 4);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+int ScriptManager::Lua_UnsubscribeFromPacket(lua_State* L) {
+    if (lua_gettop(L) != 1 || !lua_isnumber(L, 1)) {
+        lua_pushstring(L, "Usage: UnsubscribeFromPacket(id)");
+        lua_error(L);
+        return 0;
+    }
+
+    script_manager.UnsubscribeFromPacket(static_cast<subscription_id>(lua_tointeger(L, 1)));
+    return 0;
+}
@@ -1,6 +1,11 @@
 #pragma once
 #include "pch.h"
 #include "lua.hpp"
+#include <memory>
+#include <mutex>
+#include "latency_trace.h"
+#include "packet_registry.h"
+#include "worker.h"
 class ScriptManager {
 public:
     ScriptManager();
@@ -12,12 +17,40 @@ public:
     void RegisterFunctions();
     void SubscribeToEvent(const std::string& eventName, lua_State* L, int index);
     void TriggerEvent(const std::string& eventName);
+    subscription_id SubscribeToPacket(packet_direction direction, uint8_t opcode, int priority, lua_State* L, int index);
+    void UnsubscribeFromPacket(subscription_id id);
 
     static int Lua_SubscribeToEvent(lua_State* L);
     static int Lua_BotFunction(lua_State* L);
+    static int Lua_SubscribeToPacket(lua_State* L);
+    static int Lua_UnsubscribeFromPacket(lua_State* L);
 private:
+    // A packet waiting for a script callback, the callback's ref, and the
+    // cause the packet was dispatched under.
+    struct queued_packet {
+        std::shared_ptr<int> ref;
+        packet pkt;
+        reaction_cause cause;
+    };
+
+    void DrainPacketCallbacks();
+    void RunPacketCallback(const queued_packet& queued);
+
     lua_State* L;
     std::map<std::string, std::vector<int>> eventCallbacks;
+    // The Lua state is single threaded. Packet callbacks run on the script
+    // lane; this keeps them off the state while a script loads or an event
+    // fires. Recursive because a callback may trigger an event.
+    std::recursive_mutex luaMutex;
+    // Packet callbacks never run on the dispatch lanes: the chain subscriber
+    // only queues the packet here, and one pool task at a time drains it, so
+    // a slow script delays other scripts but never packet handling. A full
+    // lane drops the packet rather than stall dispatch.
+    PacketChannel<queued_packet, 1024> scriptLane;
+    // Registry refs of packet callbacks. A callback may still be reached
+    // through a chain that is being retired after it unsubscribes, so the
+    // ref is cleared rather than the callback being destroyed.
+    std::map<subscription_id, std::shared_ptr<int>> packetCallbacks;
 };
 
 extern ScriptManager script_manager;
\ No newline at end of file
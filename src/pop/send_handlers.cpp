@@ -1,74 +1,83 @@
 // ReSharper disable CppClangTidyClangDiagnosticSwitchEnum
 #include "pch.h"
 #include "gamestate_manager.h"
-#include "packet_reader.h"
+#include "packet_layouts.h"
 #include "packet_structures.h"
 #include "structures.h"
 #include "spell.h"
+#include "task_pool.h"
 
-extern void send_handle_packet_x0E(const packet &packet)
+extern decode_error send_handle_packet_x0E(const packet &packet)
 {
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x0C(const packet &packet)
+extern decode_error send_handle_packet_x0C(const packet &packet)
 {
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x38(const packet &packet)
+extern decode_error send_handle_packet_x38(const packet &packet)
 {
     game_state.refresh_game_state();
+
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x1C(const packet &packet)
+// The equipped weapon changes a few frames after the use-item packet, so it is
+// polled on a timer rather than by holding a dispatch lane in a sleep.
+static void poll_weapon_change(std::string initialWeaponName, std::chrono::steady_clock::time_point deadline)
 {
-    std::string initialWeaponName = game_state.CurrentWeaponName();
-    std::string weaponName;
-
-    auto startTime = std::chrono::steady_clock::now();
-    auto timeout = std::chrono::milliseconds(1000);
-    bool weaponNameChanged = false;
-
-    while (std::chrono::steady_clock::now() - startTime < timeout)
+    const std::string weaponName = game_state.CurrentWeaponName();
+    if (weaponName != initialWeaponName && weaponName != "")
     {
-        weaponName = game_state.CurrentWeaponName();
-        if (weaponName != initialWeaponName && weaponName != "")
-        {
-            weaponNameChanged = true;
-            break;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        game_state.spells_manager.OnWeaponChange(weaponName);
+        return;
     }
 
-    if (weaponNameChanged)
+    if (std::chrono::steady_clock::now() < deadline)
     {
-        game_state.spells_manager.OnWeaponChange(weaponName);
+        scheduler.post_after(std::chrono::milliseconds(100), [initialWeaponName = std::move(initialWeaponName), deadline]() mutable
+                             { poll_weapon_change(std::move(initialWeaponName), deadline); });
     }
 }
 
-extern void send_handle_packet_x13(const packet &packet)
+extern decode_error send_handle_packet_x1C(const packet &packet)
+{
+    poll_weapon_change(game_state.CurrentWeaponName(), std::chrono::steady_clock::now() + std::chrono::milliseconds(1000));
+
+    return decode_error::none;
+}
+
+extern decode_error send_handle_packet_x13(const packet &packet)
 {
     if (!game_state.spellbar.HasDion())
     {
         game_state.spells_manager.cast_spell("ard cradh");
     }
+
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x10(const packet &packet)
+extern decode_error send_handle_packet_x10(const packet &packet)
 {
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x0F(const packet &packet)
+extern decode_error send_handle_packet_x0F(const packet &packet)
 {
+    return decode_error::none;
 }
 
-extern void send_handle_packet_x06(const packet &packet)
+extern decode_error send_handle_packet_x06(const packet &packet)
 {
-    PacketReader msg(packet);
-    msg.readByte();
+    auto walk = schema::decode<layouts::walk>(packet);
+    if (!walk)
+        return walk.error();
 
     Location location = game_state.get_player_location();
 
-    switch (static_cast<Direction>(msg.readByte()))
+    switch (walk->Facing)
     {
     case Direction::North:
         location.Y--;
@@ -86,4 +95,6 @@ extern void send_handle_packet_x06(const packet &packet)
     }
 
     game_state.update_player_location(location);
+
+    return decode_error::none;
 }
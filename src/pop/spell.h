@@ -2,23 +2,24 @@
 #define SPELL_H
 
 #include "pch.h"
+#include "string_interner.h"
 
 class spell
 {
 public:
-    std::string name;
+    name_id name;
     BYTE slot;
     unsigned short icon;
     BYTE type;
-    std::string prompt;
+    name_id prompt;
     BYTE castLines;
 
-    spell() : slot(0), icon(0), type(0), castLines(0)
+    spell() : name(no_name), slot(0), icon(0), type(0), prompt(no_name), castLines(0)
     {
     }
 
-    spell(const std::string &name, const BYTE &slot, unsigned short icon, const BYTE &type, const std::string &prompt, const BYTE &castLines)
-        : name(name), slot(slot), icon(icon), type(type), prompt(prompt), castLines(castLines)
+    spell(std::string_view name, const BYTE &slot, unsigned short icon, const BYTE &type, std::string_view prompt, const BYTE &castLines)
+        : name(interned_names.intern(name)), slot(slot), icon(icon), type(type), prompt(interned_names.intern(prompt)), castLines(castLines)
     {
     }
 };
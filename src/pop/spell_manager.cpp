@@ -3,51 +3,97 @@
 #include "gamestate_manager.h"
 #include "network_functions.h"
 #include "spell_manager.h"
-#include "packet_writer.h"
+#include "packet_layouts.h"
+#include "task_pool.h"
 
 
-void spell_manager::cast(const std::string spellstr)
+bool spell_manager::cast(const std::string spellstr)
 {
     spell* sp = this->find_spell_by_name(spellstr);
-    if (sp)
-    {
-        this->apply_staff_effects_to_spell(*sp);
+    if (!sp)
+        return false;
 
-        PacketWriter packet1;
-        packet1.write<byte>(0x4D);
-        packet1.write<byte>(sp->castLines);
-        packet1.write<byte>(0x00);
-        packet1.sendToServer();
+    const std::shared_ptr<pending_cast> pending = pending_cast_;
+    std::unique_lock<std::mutex> lock(pending->mutex);
+    if (pending->active)
+    {
+        std::cout << "Not casting '" << spellstr << "': '" << interned_names.view(pending->spell) << "' is still chanting." << std::endl;
+        return false;
+    }
 
-        if (sp->castLines > 0)
-        {
-            PacketWriter packet2;
-            packet2.write<byte>(0x4E);
-            packet2.writeString8(sp->name);
-            packet2.write<byte>(0x00);
-            packet2.sendToServer();
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(sp->castLines * 900));
-            PacketWriter packet3;
-            packet3.write<byte>(0x4E);
-            packet3.writeString8(sp->name);
-            packet3.write<byte>(0x00);
-            packet3.sendToServer();
-        }
+    this->apply_staff_effects_to_spell(*sp);
+    PacketWriter packet1;
+    schema::encode<layouts::cast_lines>(packet1, {sp->castLines});
+    std::move(packet1).sendToServer();
 
+    if (sp->castLines <= 0)
+    {
+        const Location location = game_state.get_player_location();
         PacketWriter packet4;
-        packet4.write<byte>(0x0F);
-        packet4.write<byte>(sp->slot);
-        packet4.write<unsigned int>(game_state.get_serial());
-        packet4.write<unsigned short>(game_state.get_player_location().X);
-        packet4.write<unsigned short>(game_state.get_player_location().Y);
-        packet4.sendToServer();
+        schema::encode<layouts::cast_spell>(packet4, {sp->slot, game_state.get_serial(), location.X, location.Y});
+        std::move(packet4).sendToServer();
+        return true;
+    }
+
+    PacketWriter packet2;
+    schema::encode<layouts::cast_chant>(packet2, {interned_names.view(sp->name)});
+    std::move(packet2).sendToServer();
+
+    const Location location = game_state.get_player_location();
+    pending->active = true;
+    pending->slot = sp->slot;
+    pending->spell = sp->name;
+    pending->serial = game_state.get_serial();
+    pending->x = location.X;
+    pending->y = location.Y;
+    const uint64_t generation = ++pending->generation;
+
+    // The chant takes 900ms a line; finish it on a timer instead of blocking
+    // the caller for the whole cast.
+    scheduler.post_after(std::chrono::milliseconds(sp->castLines * 900), [this, generation]()
+                         { finish_cast(generation); });
+    return true;
+}
+
+// Sends the last chant line and the 0x0F release, but only if the cast is
+// still the one that was started and still valid: the spell has not left its
+// slot, and the player has neither moved (which breaks the chant) nor been
+// given a new serial by a map change.
+void spell_manager::finish_cast(uint64_t generation)
+{
+    const std::shared_ptr<pending_cast> pending = pending_cast_;
+    std::lock_guard<std::mutex> lock(pending->mutex);
+    if (!pending->active || pending->generation != generation)
+        return;
+    pending->active = false;
+
+    const spell *sp = find_spell_by_slot(pending->slot);
+    const Location location = game_state.get_player_location();
+    if (sp == nullptr || sp->name != pending->spell || game_state.get_serial() != pending->serial ||
+        location.X != pending->x || location.Y != pending->y)
+    {
+        std::cout << "Dropped the release of '" << interned_names.view(pending->spell) << "': the cast is no longer valid." << std::endl;
+        return;
     }
+
+    PacketWriter packet3;
+    schema::encode<layouts::cast_chant>(packet3, {interned_names.view(pending->spell)});
+    std::move(packet3).sendToServer();
+
+    PacketWriter packet4;
+    schema::encode<layouts::cast_spell>(packet4, {pending->slot, pending->serial, location.X, location.Y});
+    std::move(packet4).sendToServer();
 }
 
 
 void spell_manager::cast_spell(const std::string &spell_name)
 {
+    if (is_casting())
+    {
+        std::cout << "Not casting '" << spell_name << "': another cast is still chanting." << std::endl;
+        return;
+    }
+
     const auto lower_spell_name = to_lower(spell_name);
     const auto &bestStaffMap = determine_best_staff_for_spells();
 
@@ -82,7 +128,7 @@ void spell_manager::cast_spell(const std::string &spell_name)
         if (staff.has_value() && !game_state.spellbar.HasPramh() && !game_state.spellbar.HasWolfFangFist() && game_state.CurrentWeaponName() != *current_weapon_)
         {
             *current_weapon_ = bestStaff;
-            ITEM(static_cast<byte>(staff.value().InventorySlot));
+            outgoing::use_item.send(staff.value().InventorySlot);
         }
     }
     else if (!bestStaff.empty())
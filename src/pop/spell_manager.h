@@ -6,6 +6,7 @@
 #include "SpellEffect.h"
 #include "gamestate_manager.h"
 #include "spell.h"
+#include "task_pool.h"
 
 class spell_manager : public IWeaponChangeObserver
 {
@@ -18,8 +19,27 @@ private:
 
     std::map<std::string, std::pair<std::string, int>> best_staff_cache_;
 
+    // The cast whose chant is still running. Only one cast is in flight at a
+    // time: a second chant would make the server drop the first. generation
+    // moves on with every cast, so a release timer only ever finishes the
+    // cast that armed it.
+    struct pending_cast
+    {
+        std::mutex mutex;
+        bool active = false;
+        uint64_t generation = 0;
+        BYTE slot = 0;
+        name_id spell = no_name;
+        unsigned int serial = 0;
+        USHORT x = 0;
+        USHORT y = 0;
+    };
+    std::shared_ptr<pending_cast> pending_cast_;
+
+    void finish_cast(uint64_t generation);
+
 public:
-    spell_manager() : current_weapon_(std::make_shared<std::string>(""))
+    spell_manager() : current_weapon_(std::make_shared<std::string>("")), pending_cast_(std::make_shared<pending_cast>())
     {
         spells_.resize(90);
     }
@@ -96,8 +116,12 @@ public:
 
     spell* find_spell_by_name(const std::string& spellName)
     {
-        auto it = std::find_if(spells_.begin(), spells_.end(), [&spellName](const spell& sp)
-            { return sp.name == spellName; });
+        const name_id id = interned_names.find(spellName);
+        if (id == no_name)
+            return nullptr;
+
+        auto it = std::find_if(spells_.begin(), spells_.end(), [id](const spell& sp)
+            { return sp.name == id; });
 
         if (it != spells_.end())
         {
@@ -129,7 +153,14 @@ public:
         }
     }
 
-    void cast(const std::string spellstr);
+    // Starts a cast unless one is already chanting; returns false if so.
+    bool cast(const std::string spellstr);
+
+    bool is_casting() const
+    {
+        std::lock_guard<std::mutex> lock(pending_cast_->mutex);
+        return pending_cast_->active;
+    }
 
     void Update(const std::string &equipped_weapon)
     {
@@ -170,16 +201,14 @@ public:
 
     void add_spell(spell &spell)
     {
-        std::string spellName(spell.name);
-        size_t pos = spellName.find(" (");
+        const std::string_view spellName = interned_names.view(spell.name);
+        const size_t pos = spellName.find(" (");
 
-        if (pos != std::string::npos)
+        if (pos != std::string_view::npos)
         {
-            spellName = spellName.substr(0, pos);
+            spell.name = interned_names.intern(spellName.substr(0, pos));
         }
 
-        spell.name = std::string(spellName);
-
         spells_[spell.slot] = spell;
     }
 
@@ -3,7 +3,7 @@
 #include "network_functions.h"
 #include "packet_structures.h"
 #include "obj_managers.h"
-#include "packet_reader.h"
+#include "packet_view.h"
 #include "structures.h"
 #include <iostream>
 #include <exception>
@@ -12,7 +12,7 @@ void ProcessSpritePacket(const std::vector<unsigned char> &packetData)
 {
     try
     {
-        PacketReader msg(packetData);
+        PacketView msg(packetData.data(), packetData.size());
         msg.readByte(); // Skip packet ID
 
         auto count = msg.read<uint16_t>();
@@ -0,0 +1,105 @@
+#pragma once
+#include "pch.h"
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Stable handle for an interned string. Two names are equal exactly when
+// their ids are, so comparing them is an integer compare.
+using name_id = uint32_t;
+
+// Id of the empty string; also what an unset name holds.
+constexpr name_id no_name = 0;
+
+// Process-wide table of the names the server keeps repeating: players,
+// items, spells. Interning the same bytes always yields the same id and the
+// view behind an id never moves or dies, so it can be held anywhere.
+//
+// Lookups take a shared lock; only a name seen for the first time takes the
+// exclusive one.
+class string_interner
+{
+public:
+    string_interner()
+    {
+        views_.emplace_back();
+    }
+
+    string_interner(const string_interner &) = delete;
+    string_interner &operator=(const string_interner &) = delete;
+
+    name_id intern(std::string_view text)
+    {
+        if (text.empty())
+            return no_name;
+
+        {
+            std::shared_lock lock(mutex_);
+            if (const auto it = ids_.find(text); it != ids_.end())
+                return it->second;
+        }
+
+        std::unique_lock lock(mutex_);
+        if (const auto it = ids_.find(text); it != ids_.end())
+            return it->second;
+
+        // std::deque never relocates existing elements, so views into the
+        // stored strings stay valid as the table grows.
+        const std::string_view stored = storage_.emplace_back(text);
+        const auto id = static_cast<name_id>(views_.size());
+        views_.push_back(stored);
+        ids_.emplace(stored, id);
+        return id;
+    }
+
+    // Looks a name up without adding it; no_name when it was never interned.
+    name_id find(std::string_view text) const
+    {
+        if (text.empty())
+            return no_name;
+
+        std::shared_lock lock(mutex_);
+        const auto it = ids_.find(text);
+        return it != ids_.end() ? it->second : no_name;
+    }
+
+    std::string_view view(name_id id) const
+    {
+        std::shared_lock lock(mutex_);
+        return id < views_.size() ? views_[id] : std::string_view();
+    }
+
+    size_t size() const
+    {
+        std::shared_lock lock(mutex_);
+        return views_.size() - 1;
+    }
+
+private:
+    // FNV-1a. Names are short, so a byte loop beats anything that needs a
+    // setup step.
+    struct name_hash
+    {
+        size_t operator()(std::string_view text) const
+        {
+            uint32_t hash = 2166136261u;
+            for (const char c : text)
+            {
+                hash ^= static_cast<uint8_t>(c);
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+    };
+
+    mutable std::shared_mutex mutex_;
+    std::deque<std::string> storage_;
+    std::vector<std::string_view> views_;
+    std::unordered_map<std::string_view, name_id, name_hash> ids_;
+};
+
+inline string_interner interned_names;
@@ -143,12 +143,7 @@ public:
         {
             Location predictedLocation = other.predictLocation(steps);
             FacingDirection = determineFacingDirection(predictedLocation);
-            // Assuming game_function::send_to_server exists and takes a unique_ptr to a BYTE array
-            auto message = std::make_unique<BYTE[]>(3);
-            message[0] = 0x11;
-            message[1] = static_cast<BYTE>(FacingDirection);
-            message[2] = 0x00;
-            game_function::send_to_server(std::move(message).get(), 3);
+            outgoing::face.send(FacingDirection);
             // Assuming AMBUSH is a macro or function that performs the ambush
         }
     }
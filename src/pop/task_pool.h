@@ -0,0 +1,629 @@
+#pragma once
+#include "pch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+#include "latency_trace.h"
+
+// The one pool every background subsystem runs on: packet dispatch lanes,
+// the game-state tick, deferred handler work. Each worker owns a deque; it
+// pushes and pops its own work LIFO and, once that runs dry, steals the
+// oldest task from a sibling. Work posted from outside the pool lands in a
+// shared injection queue.
+//
+// Timers live in a deadline heap owned by a timer thread that sleeps until
+// the nearest deadline and posts what is due, so a saturated pool delays a
+// timer's work but never its firing. Watchdogs that must run even when every
+// worker is stuck run on the timer thread itself (watch_every). The UI
+// thread is the other dedicated thread: Win32 windows must be pumped by the
+// thread that made them, so it runs the overlay's message loop and drains
+// the tasks posted to it between messages.
+//
+// A worker that runs dry does not park straight away. Depending on the wait
+// mode it first spins on the pending count, then yields its time slice, and
+// only then sleeps on the condition variable; a wakeup through the kernel
+// costs tens of microseconds on Windows, a burst of combat packets arrives
+// faster than that.
+enum class wait_mode : uint8_t
+{
+    // Sleep as soon as there is nothing to run. Cheapest on CPU.
+    park,
+    // Spin for about twice the worker's recent idle gap, up to max_spin, so
+    // spinning only happens while work is arriving that fast.
+    adaptive,
+    // Always spin for max_spin before yielding. Lowest latency, most CPU.
+    spin,
+};
+
+struct wait_stats
+{
+    // Idle periods that ended while spinning, while yielding, or after the
+    // worker had parked.
+    uint64_t spin_wakes = 0;
+    uint64_t yield_wakes = 0;
+    uint64_t parks = 0;
+};
+
+class task_pool
+{
+public:
+    using task = std::function<void()>;
+    using clock = std::chrono::steady_clock;
+    using timer_id = uint64_t;
+
+    // Thread message telling the UI loop to call run_ui_tasks().
+    static constexpr UINT ui_task_message = WM_APP + 0x51;
+
+    static constexpr auto max_spin = std::chrono::microseconds(50);
+    static constexpr int yield_rounds = 4;
+
+    // Half the cores, leaving the rest to the game.
+    static size_t default_thread_count()
+    {
+        return std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 2, 4);
+    }
+
+    task_pool() = default;
+    task_pool(const task_pool &other) = delete;
+    task_pool &operator=(const task_pool &other) = delete;
+
+    // Stops the pool if shutdown() has not, then waits for every thread,
+    // including any shutdown() detached, to leave its loop before the
+    // members they use go away. The process-wide scheduler is never
+    // destroyed (see dllmain.cpp): at process exit its threads are killed
+    // without leaving their loops, and this would wait for them forever.
+    ~task_pool()
+    {
+        stopping.store(true);
+        wake_for_stop();
+
+        {
+            std::unique_lock<std::mutex> lock(exitMutex);
+            exitCv.wait(lock, [this]
+                        { return running == 0; });
+        }
+        for (auto &thread : threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+    void start(size_t thread_count = default_thread_count())
+    {
+        if (started.exchange(true))
+            return;
+
+        for (size_t i = 0; i < thread_count; ++i)
+            workers.push_back(std::make_unique<worker>());
+
+        {
+            std::lock_guard<std::mutex> lock(exitMutex);
+            running += thread_count + 1;
+        }
+        for (size_t i = 0; i < thread_count; ++i)
+            threads.emplace_back(&task_pool::worker_loop, this, i);
+        threads.emplace_back(&task_pool::timer_loop, this);
+    }
+
+    // Runs body on the dedicated UI thread. body owns the message loop and
+    // must hand ui_task_message to run_ui_tasks(). Starts the pool first if
+    // it is not running, so shutdown() always covers the UI thread.
+    void start_ui(task body)
+    {
+        start();
+        {
+            std::lock_guard<std::mutex> lock(exitMutex);
+            ++running;
+        }
+        threads.emplace_back([this, body = std::move(body)]() mutable
+                             {
+            // Make sure the thread has a message queue before anyone posts.
+            MSG msg;
+            PeekMessage(&msg, nullptr, WM_USER, WM_USER, PM_NOREMOVE);
+            uiThreadId = GetCurrentThreadId();
+            run_ui_tasks();
+
+            run_guarded(body);
+
+            uiThreadId = 0;
+            exited(); });
+    }
+
+    void post(task work)
+    {
+        post_untraced(carry_cause(std::move(work)));
+    }
+
+    // As post(), but the task does not inherit the poster's cause. For
+    // plumbing that runs other packets' work, such as a lane's drain: each
+    // packet it dispatches sets its own cause.
+    void post_untraced(task work)
+    {
+        if (stopping.load(std::memory_order_relaxed))
+            return;
+
+        if (current_pool == this)
+        {
+            auto &own = *workers[current_index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.tasks.push_back(std::move(work));
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            injected.push_back(std::move(work));
+        }
+        pending.fetch_add(1, std::memory_order_seq_cst);
+        wake_one();
+    }
+
+    // Runs work on the pool, then then(result) as a follow-up task.
+    template <typename Work, typename Then>
+    void post(Work work, Then then)
+    {
+        post([this, work = std::move(work), then = std::move(then)]() mutable
+             {
+            if constexpr (std::is_void_v<std::invoke_result_t<Work &>>)
+            {
+                work();
+                post(std::move(then));
+            }
+            else
+            {
+                post([then = std::move(then), result = work()]() mutable
+                     { then(std::move(result)); });
+            } });
+    }
+
+    void post_to_ui(task work)
+    {
+        {
+            std::lock_guard<std::mutex> lock(uiMutex);
+            uiTasks.push_back(std::move(work));
+        }
+        if (const DWORD id = uiThreadId.load(std::memory_order_acquire); id != 0)
+            PostThreadMessage(id, ui_task_message, 0, 0);
+    }
+
+    // Called by the UI loop on ui_task_message.
+    void run_ui_tasks()
+    {
+        std::vector<task> batch;
+        {
+            std::lock_guard<std::mutex> lock(uiMutex);
+            batch.swap(uiTasks);
+        }
+        for (auto &work : batch)
+            run_guarded(work);
+    }
+
+    timer_id post_after(clock::duration delay, task work)
+    {
+        return add_timer(clock::now() + delay, clock::duration::zero(), carry_cause(std::move(work)));
+    }
+
+    // Runs work every interval, measured from the end of the previous run so
+    // a slow tick never overlaps itself.
+    timer_id post_every(clock::duration interval, task work)
+    {
+        return add_timer(clock::now() + interval, interval, std::move(work));
+    }
+
+    // Runs work every interval on the timer thread itself rather than on a
+    // worker, so it still runs when every worker is blocked. work must be
+    // short and must never block: it delays every other timer.
+    timer_id watch_every(clock::duration interval, task work)
+    {
+        return add_timer(clock::now() + interval, interval, std::move(work), true);
+    }
+
+    void cancel(timer_id id)
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        cancelled.insert(id);
+    }
+
+    // Stops accepting work, tells the UI loop to quit and waits up to timeout
+    // for every thread to leave its loop, then joins them. Threads still
+    // running at the timeout are detached. Never call this from DllMain:
+    // the threads cannot exit while the loader lock is held.
+    void shutdown(std::chrono::milliseconds timeout = std::chrono::milliseconds(500))
+    {
+        if (!started.load() || stopping.exchange(true))
+            return;
+
+        wake_for_stop();
+
+        bool exited;
+        {
+            std::unique_lock<std::mutex> lock(exitMutex);
+            exited = exitCv.wait_for(lock, timeout, [this]
+                                     { return running == 0; });
+        }
+
+        for (auto &thread : threads)
+        {
+            if (!thread.joinable())
+                continue;
+            if (exited)
+                thread.join();
+            else
+                thread.detach();
+        }
+    }
+
+    void set_wait_mode(wait_mode value)
+    {
+        mode.store(value, std::memory_order_relaxed);
+    }
+
+    wait_mode get_wait_mode() const
+    {
+        return mode.load(std::memory_order_relaxed);
+    }
+
+    wait_stats waits() const
+    {
+        return wait_stats{spinWakes.load(std::memory_order_relaxed),
+                          yieldWakes.load(std::memory_order_relaxed),
+                          parks.load(std::memory_order_relaxed)};
+    }
+
+    size_t thread_count() const
+    {
+        return workers.size();
+    }
+
+    bool on_pool_thread() const
+    {
+        return current_pool == this;
+    }
+
+private:
+    struct worker
+    {
+        std::mutex mutex;
+        std::deque<task> tasks;
+        // Moving average of how long this worker sits idle before work
+        // shows up. Only its own thread touches it.
+        clock::duration idleAverage = max_spin;
+    };
+
+    struct timer
+    {
+        clock::time_point deadline;
+        timer_id id;
+        clock::duration interval;
+        std::shared_ptr<task> work;
+        // Runs on the timer thread instead of being posted.
+        bool onTimerThread;
+
+        bool operator>(const timer &other) const
+        {
+            return deadline > other.deadline;
+        }
+    };
+
+    static inline thread_local task_pool *current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> started{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<wait_mode> mode{wait_mode::adaptive};
+    const bool canSpin = std::thread::hardware_concurrency() > 1;
+    std::atomic<uint64_t> spinWakes{0};
+    std::atomic<uint64_t> yieldWakes{0};
+    std::atomic<uint64_t> parks{0};
+
+    std::mutex injectMutex;
+    std::deque<task> injected;
+    std::atomic<size_t> pending{0};
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCv;
+    std::atomic<size_t> sleepers{0};
+
+    std::mutex timerMutex;
+    std::condition_variable timerCv;
+    std::priority_queue<timer, std::vector<timer>, std::greater<>> timers;
+    std::unordered_set<timer_id> cancelled;
+    timer_id nextTimerId = 1;
+
+    std::mutex uiMutex;
+    std::vector<task> uiTasks;
+    std::atomic<DWORD> uiThreadId{0};
+
+    std::mutex exitMutex;
+    std::condition_variable exitCv;
+    size_t running = 0;
+
+    static void run_guarded(task &work)
+    {
+        try
+        {
+            work();
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Task failed: " << e.what() << std::endl;
+        }
+        catch (...)
+        {
+            std::cout << "Task failed" << std::endl;
+        }
+    }
+
+    // Work a handler posts while a packet is being dispatched runs with that
+    // packet as its cause, so whatever it sends is traced back to it.
+    // Periodic timers and post_untraced work are left alone: they outlive
+    // any one packet.
+    static task carry_cause(task work)
+    {
+        const reaction_cause cause = latency_trace::current();
+        if (!cause)
+            return work;
+        return [cause, work = std::move(work)]()
+        {
+            latency_trace::cause_scope scope(cause);
+            work();
+        };
+    }
+
+    void exited()
+    {
+        std::lock_guard<std::mutex> lock(exitMutex);
+        --running;
+        exitCv.notify_all();
+    }
+
+    // Wakes every thread that may be waiting, once stopping is set.
+    void wake_for_stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            sleepCv.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(timerMutex);
+            timerCv.notify_all();
+        }
+        if (const DWORD id = uiThreadId.load(std::memory_order_acquire); id != 0)
+            PostThreadMessage(id, WM_QUIT, 0, 0);
+    }
+
+    void wake_one()
+    {
+        if (sleepers.load(std::memory_order_seq_cst) != 0)
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            sleepCv.notify_one();
+        }
+    }
+
+    timer_id add_timer(clock::time_point deadline, clock::duration interval, task work, bool onTimerThread = false)
+    {
+        std::lock_guard<std::mutex> lock(timerMutex);
+        const timer_id id = nextTimerId++;
+        timers.push(timer{deadline, id, interval, std::make_shared<task>(std::move(work)), onTimerThread});
+        timerCv.notify_one();
+        return id;
+    }
+
+    bool take(size_t index, task &out)
+    {
+        {
+            auto &own = *workers[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                out = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(injectMutex);
+            if (!injected.empty())
+            {
+                out = std::move(injected.front());
+                injected.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            auto &victim = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                out = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Sleeps until the nearest deadline, then posts what is due. Watchdog
+    // timers run here directly and are re-armed at once; pooled periodic
+    // timers are re-armed when their run finishes, so they never overlap.
+    void timer_loop()
+    {
+        std::unique_lock<std::mutex> lock(timerMutex);
+        while (!stopping.load(std::memory_order_relaxed))
+        {
+            if (timers.empty())
+            {
+                timerCv.wait(lock);
+                continue;
+            }
+            if (const auto deadline = timers.top().deadline; deadline > clock::now())
+            {
+                timerCv.wait_until(lock, deadline);
+                continue;
+            }
+
+            timer fired = timers.top();
+            timers.pop();
+            if (cancelled.erase(fired.id) != 0)
+                continue;
+
+            lock.unlock();
+            if (fired.onTimerThread)
+            {
+                run_guarded(*fired.work);
+                rearm(fired);
+            }
+            else
+            {
+                post_untraced([this, fired]()
+                              {
+                    run_guarded(*fired.work);
+                    if (fired.interval != clock::duration::zero())
+                        rearm(fired); });
+            }
+            lock.lock();
+        }
+
+        lock.unlock();
+        exited();
+    }
+
+    void rearm(timer fired)
+    {
+        if (fired.interval == clock::duration::zero())
+            return;
+
+        std::lock_guard<std::mutex> lock(timerMutex);
+        if (cancelled.erase(fired.id) != 0)
+            return;
+        fired.deadline = clock::now() + fired.interval;
+        timers.push(fired);
+        timerCv.notify_one();
+    }
+
+    bool has_work() const
+    {
+        return pending.load(std::memory_order_acquire) != 0 ||
+               stopping.load(std::memory_order_relaxed);
+    }
+
+    clock::duration spin_budget(const worker &own) const
+    {
+        // On one core a spinning worker only delays whoever would post.
+        if (!canSpin)
+            return clock::duration::zero();
+
+        switch (mode.load(std::memory_order_relaxed))
+        {
+        case wait_mode::park:
+            return clock::duration::zero();
+        case wait_mode::spin:
+            return max_spin;
+        default:
+            return own.idleAverage < max_spin ? (std::min<clock::duration>)(own.idleAverage * 2, max_spin)
+                                              : clock::duration::zero();
+        }
+    }
+
+    // Spins, then yields, watching for work. True when work turned up
+    // before the worker would have to park.
+    bool spin_wait(worker &own)
+    {
+        const auto budget = spin_budget(own);
+        if (budget == clock::duration::zero())
+            return false;
+
+        const auto until = clock::now() + budget;
+
+        // The clock is read once per batch of pauses; a pause is tens of
+        // cycles, a clock read on Windows is more.
+        do
+        {
+            for (int i = 0; i < 64; ++i)
+            {
+                if (has_work())
+                {
+                    spinWakes.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                YieldProcessor();
+            }
+        } while (clock::now() < until);
+
+        for (int i = 0; i < yield_rounds; ++i)
+        {
+            std::this_thread::yield();
+            if (has_work())
+            {
+                yieldWakes.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void idle_wait()
+    {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (pending.load(std::memory_order_seq_cst) == 0 &&
+            !stopping.load(std::memory_order_relaxed))
+        {
+            parks.fetch_add(1, std::memory_order_relaxed);
+            sleepCv.wait(lock);
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void worker_loop(size_t index)
+    {
+        current_pool = this;
+        current_index = index;
+
+        auto &own = *workers[index];
+        std::optional<clock::time_point> idleSince;
+        task work;
+        while (!stopping.load(std::memory_order_relaxed))
+        {
+            if (take(index, work))
+            {
+                if (idleSince)
+                {
+                    // 1/8 weight to the newest gap.
+                    own.idleAverage += (clock::now() - *idleSince - own.idleAverage) / 8;
+                    idleSince.reset();
+                }
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                run_guarded(work);
+                work = nullptr;
+                continue;
+            }
+
+            if (!idleSince)
+                idleSince = clock::now();
+            if (spin_wait(own))
+                continue;
+            idle_wait();
+        }
+
+        exited();
+    }
+};
+
+extern task_pool &scheduler;
@@ -2,6 +2,7 @@
 #include "pch.h"
 #include "gamestate_manager.h"
 #include "script_manager.h"
+#include "task_pool.h"
 
 #define ID_LOAD_SCRIPT 1
 #define ID_START_SCRIPT 2
@@ -17,9 +18,15 @@ public:
     inline static HWND hStartButton = nullptr;
     inline static HWND hStopButton = nullptr;
 
+    // May be called from any thread. The hook and the window are created on
+    // the UI thread: a low-level keyboard hook is called back on the thread
+    // that installed it, and a window belongs to the thread that created it,
+    // so both must live on the thread whose message loop pumps them.
     static void Initialize(HINSTANCE hInstance) {
-        std::thread initThread(&GuiManager::InitThreadProc, hInstance);
-        initThread.detach();
+        scheduler.post_to_ui([hInstance]() {
+            SetKeyboardHook();
+            CreateGuiWindow(hInstance);
+        });
     }
 
     static void Cleanup() {
@@ -30,17 +37,6 @@ public:
     }
 
 private:
-    static void InitThreadProc(HINSTANCE hInstance) {
-        SetKeyboardHook();
-        CreateGuiWindow(hInstance);
-
-        MSG msg;
-        while (GetMessage(&msg, nullptr, 0, 0)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-    }
-
     static void ToggleGuiVisibility() {
         guiVisible = !guiVisible;
         ShowWindow(hGuiWnd, guiVisible ? SW_SHOW : SW_HIDE);
@@ -138,8 +134,11 @@ private:
         case WM_SIZE:
             // Handle window resizing
             break;
-        case WM_DESTROY:
-            PostQuitMessage(0);
+        case WM_CLOSE:
+            // The window shares the overlay's message loop; closing it must
+            // not end that loop, so it is only hidden until the next F12.
+            guiVisible = false;
+            ShowWindow(hWnd, SW_HIDE);
             break;
         default:
             return DefWindowProc(hWnd, message, wParam, lParam);
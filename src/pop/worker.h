@@ -2,6 +2,16 @@
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <array>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 
 template <typename T>
 class ThreadSafeQueue
@@ -49,4 +59,388 @@ public:
         std::lock_guard<std::mutex> lock(mutex);
         return queue.empty();
     }
-};
\ No newline at end of file
+};
+
+// Bounded single-producer/single-consumer ring. Head and tail live on
+// separate cache lines, and each side keeps a cached copy of the other's
+// index so it only touches the shared line when its cached view runs out.
+// Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+private:
+    static constexpr size_t mask = Capacity - 1;
+
+    std::unique_ptr<T[]> slots = std::make_unique<T[]>(Capacity);
+
+    alignas(64) std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing &other) = delete;
+    SpscRing &operator=(const SpscRing &other) = delete;
+
+    // Producer side. Returns false, leaving value untouched, when full.
+    bool try_push(T &value)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead == Capacity)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead == Capacity)
+                return false;
+        }
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Hands up to limit elements that are already published
+    // to consume, in order, and frees the slots once with a single store.
+    template <typename Consume>
+    size_t drain(Consume &&consume, size_t limit = Capacity)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+                return 0;
+        }
+
+        const size_t end = h + (std::min)(cachedTail - h, limit);
+        for (size_t i = h; i != end; ++i)
+        {
+            T value = std::move(slots[i & mask]);
+            consume(value);
+        }
+        head.store(end, std::memory_order_release);
+        return end - h;
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+};
+
+// An SpscRing drained by tasks instead of a thread of its own. The channel
+// is either idle or has exactly one consumer task scheduled: the push that
+// finds it idle claims it and calls the schedule callback, and the consumer
+// hands it back with release() once it runs out of work. Producers never lock
+// or make a system call unless they are the one to schedule.
+//
+// Pushes are serialised by a flag that is uncontended when, as intended,
+// only the game's network thread produces; it keeps the ring sound if a
+// second thread (an injected send) ever pushes too.
+//
+// A value that must not be lost can be pushed with push_or_spill. If the ring
+// is full it goes to a locked overflow list instead, and until the consumer
+// has taken that list every ordinary push is dropped, so nothing overtakes
+// a spilled value.
+template <typename T, size_t Capacity>
+class PacketChannel
+{
+private:
+    SpscRing<T, Capacity> ring;
+    std::atomic_flag producing = ATOMIC_FLAG_INIT;
+    std::atomic<bool> scheduled{false};
+    std::function<void()> schedule;
+    std::atomic<uint64_t> dropped{0};
+
+    std::mutex overflowMutex;
+    std::vector<T> overflow;
+    std::vector<T> overflowDrain;
+    std::atomic<bool> spilling{false};
+    std::atomic<uint64_t> spilled{0};
+
+    template <typename Stamp>
+    bool pushImpl(T &value, Stamp &stamp, bool spill)
+    {
+        while (producing.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+        stamp(value);
+        bool pushed = !spilling.load(std::memory_order_acquire) && ring.try_push(value);
+        if (!pushed && spill)
+        {
+            std::lock_guard<std::mutex> lock(overflowMutex);
+            overflow.push_back(std::move(value));
+            spilling.store(true, std::memory_order_release);
+            spilled.fetch_add(1, std::memory_order_relaxed);
+            pushed = true;
+        }
+        producing.clear(std::memory_order_release);
+
+        if (!pushed)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Pairs with the fence in release(): either we see the consumer
+        // idle or it sees our value.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!scheduled.load(std::memory_order_relaxed) && !scheduled.exchange(true, std::memory_order_acq_rel))
+            schedule();
+        return true;
+    }
+
+    bool idle() const
+    {
+        return ring.empty() && !spilling.load(std::memory_order_acquire);
+    }
+
+    // Spilled values were pushed after everything still in the ring, so they
+    // are only taken once the ring is empty.
+    template <typename Consume>
+    size_t drainPending(Consume &consume, size_t limit)
+    {
+        size_t n = ring.drain(consume, limit);
+        if (spilling.load(std::memory_order_acquire) && ring.empty())
+        {
+            {
+                std::lock_guard<std::mutex> lock(overflowMutex);
+                overflowDrain.swap(overflow);
+                spilling.store(false, std::memory_order_release);
+            }
+            for (auto &value : overflowDrain)
+                consume(value);
+            n += overflowDrain.size();
+            overflowDrain.clear();
+        }
+        return n;
+    }
+
+public:
+    // Returns false and counts a drop when the ring is full; the producer is
+    // the game's thread and must never wait for us.
+    bool push(T value)
+    {
+        return push(std::move(value), [](T &) {});
+    }
+
+    // As push(), with stamp applied to the value under the producer flag,
+    // so whatever it assigns (a sequence number) matches ring order.
+    template <typename Stamp>
+    bool push(T value, Stamp &&stamp)
+    {
+        return pushImpl(value, stamp, false);
+    }
+
+    // As push(), but never drops.
+    template <typename Stamp>
+    void push_or_spill(T value, Stamp &&stamp)
+    {
+        pushImpl(value, stamp, true);
+    }
+
+    // Set once, before the first push. Called on the producer's thread and
+    // must only queue the consumer, not run it.
+    void set_schedule(std::function<void()> callback)
+    {
+        schedule = std::move(callback);
+    }
+
+    // Consumer side: drains up to limit pending values.
+    template <typename Consume>
+    size_t drain(Consume &&consume, size_t limit = Capacity)
+    {
+        return drainPending(consume, limit);
+    }
+
+    // Consumer side, once it has nothing left to do: marks the channel idle.
+    // Returns true when values arrived meanwhile and the caller has reclaimed
+    // the channel and must keep draining.
+    bool release()
+    {
+        scheduled.store(false, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (idle())
+            return false;
+        return !scheduled.exchange(true, std::memory_order_acq_rel);
+    }
+
+    size_t depth() const
+    {
+        return ring.size();
+    }
+
+    uint64_t dropped_count() const
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    uint64_t spilled_count() const
+    {
+        return spilled.load(std::memory_order_relaxed);
+    }
+};
+
+// FIFO lanes served in strict priority order, lane 0 first. A non-empty lane
+// that has been passed over starvation_limit times in a row is served next
+// regardless, so a sustained flood on a higher lane still lets lower lanes
+// through at a bounded rate. Owned by a single consumer thread.
+//
+// A value pushed with a non-zero key supersedes a waiting value with the same
+// key: the older one is discarded in place and the newer one queues at the
+// back, so it is never dispatched ahead of anything that arrived before it.
+//
+// Constructed with by_priority false, values still wait and are counted per
+// lane but come out in arrival order across every lane, for consumers whose
+// values must never overtake each other.
+template <typename T, size_t Lanes>
+class PriorityLanes
+{
+private:
+    struct entry
+    {
+        T value;
+        uint64_t key;
+        bool live;
+        uint64_t arrival;
+    };
+
+    // std::deque keeps references to its elements valid across push_back
+    // and pop_front, so waiting keys can point straight at their entry.
+    std::array<std::deque<entry>, Lanes> lanes;
+    std::array<size_t, Lanes> liveCount{};
+    std::array<uint32_t, Lanes> passedOver{};
+    std::unordered_map<uint64_t, entry *> waiting;
+    size_t total = 0;
+    uint64_t arrivals = 0;
+    uint32_t starvationLimit;
+    bool byPriority;
+
+    // The lane whose oldest live value arrived first.
+    size_t oldest()
+    {
+        size_t chosen = Lanes;
+        for (size_t i = 0; i < Lanes; ++i)
+        {
+            if (liveCount[i] == 0)
+                continue;
+            auto &lane = lanes[i];
+            while (!lane.front().live)
+                lane.pop_front();
+            if (chosen == Lanes || lane.front().arrival < lanes[chosen].front().arrival)
+                chosen = i;
+        }
+        return chosen;
+    }
+
+public:
+    explicit PriorityLanes(uint32_t starvation_limit = 8, bool by_priority = true)
+        : starvationLimit(starvation_limit), byPriority(by_priority) {}
+
+    PriorityLanes(const PriorityLanes &other) = delete;
+    PriorityLanes &operator=(const PriorityLanes &other) = delete;
+
+    // Returns true when the value superseded a waiting one.
+    bool push(T value, size_t lane, uint64_t key = 0)
+    {
+        auto &queued = lanes[lane].emplace_back(entry{std::move(value), key, true, arrivals++});
+        ++liveCount[lane];
+        ++total;
+        if (key == 0)
+            return false;
+
+        auto [it, inserted] = waiting.try_emplace(key, &queued);
+        if (inserted)
+            return false;
+
+        entry *older = std::exchange(it->second, &queued);
+        older->live = false;
+        older->value = T();
+        // The key includes the opcode, so both entries share a lane.
+        --liveCount[lane];
+        --total;
+        return true;
+    }
+
+    // Moves the next value into out and returns its lane, or Lanes when
+    // every lane is empty. starved is set when the lane was chosen by the
+    // starvation rule rather than by priority.
+    size_t pop(T &out, bool &starved)
+    {
+        size_t chosen = Lanes;
+        starved = false;
+        if (!byPriority)
+        {
+            chosen = oldest();
+            if (chosen == Lanes)
+                return Lanes;
+        }
+        else
+        {
+            for (size_t i = 0; i < Lanes; ++i)
+            {
+                if (liveCount[i] == 0)
+                {
+                    passedOver[i] = 0;
+                    continue;
+                }
+                if (chosen == Lanes)
+                {
+                    chosen = i;
+                }
+                else if (passedOver[i] >= starvationLimit)
+                {
+                    chosen = i;
+                    starved = true;
+                    break;
+                }
+            }
+            if (chosen == Lanes)
+                return Lanes;
+
+            for (size_t i = 0; i < Lanes; ++i)
+            {
+                if (i == chosen)
+                    passedOver[i] = 0;
+                else if (liveCount[i] != 0 && i > chosen)
+                    ++passedOver[i];
+            }
+        }
+
+        auto &lane = lanes[chosen];
+        while (!lane.front().live)
+            lane.pop_front();
+
+        entry &next = lane.front();
+        if (next.key != 0)
+            waiting.erase(next.key);
+        out = std::move(next.value);
+        lane.pop_front();
+        --liveCount[chosen];
+        --total;
+        return chosen;
+    }
+
+    bool empty() const
+    {
+        return total == 0;
+    }
+
+    size_t size() const
+    {
+        return total;
+    }
+
+    size_t depth(size_t lane) const
+    {
+        return liveCount[lane];
+    }
+};
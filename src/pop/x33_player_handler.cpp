@@ -1,100 +1,62 @@
 #include "pch.h"
 #include "packet_structures.h"
 #include "gamestate_manager.h"
-#include "packet_reader.h"
-
-constexpr bool isFirstByte33(const packet& pkt) {
-    return pkt.data[0] == 0x33;
-}
-
-template<bool Condition>
-struct PacketProcessor {
-    static void process(const packet& pkt) {
+#include "lazy_packet.h"
+#include "packet_handler.h"
+#include "packet_layouts.h"
+#include "string_interner.h"
+
+// Built without C++ exceptions, like recv_handlers.cpp (see pop.vcxproj).
+#if defined(_MSC_VER) && defined(_CPPUNWIND)
+#error x33_player_handler.cpp must be compiled with exception handling disabled
+#endif
+
+// x33 is decoded once by PacketHandlerRegistry and the same value goes to
+// every subscriber; this one keeps player_manager current.
+extern void recv_on_player_appearance(const PlayerAppearance& appearance) {
+    // Our own appearance only moves us.
+    if (interned_names.view(appearance.Name) == game_state.get_username()) {
+        game_state.update_player_serial(appearance.Serial);
+        game_state.update_player_direction(appearance.Facing);
+        game_state.update_player_location(Location(appearance.X, appearance.Y, appearance.Facing));
+        return;
     }
-};
-
-template<>
-struct PacketProcessor<true> {
-    static void process(const packet& pkt) {
-        try {
-            Player p;
-            PacketReader msg(pkt);
-
-            msg.readByte();
-
-            p.Position.X = msg.read<unsigned short>();
-            p.Position.Y = msg.read<unsigned short>();
-            p.Position.FacingDirection = static_cast<Direction>(msg.read<unsigned char>());
-            p.Serial = msg.read<unsigned int>();
-            p.Head = msg.read<unsigned short>();
 
-            if (p.Head == 0xFFFF) {
-                p.Form = msg.read<unsigned short>();
-                p.Body = 0;
-                p.Arms = msg.read<unsigned char>();
-                p.Boots = msg.read<unsigned char>();
-                p.Armor = msg.read<unsigned short>();
-                p.Shield = msg.read<unsigned char>();
-                p.Weapon = msg.read<unsigned short>();
-                msg.readBytes(1); 
-            }
-            else {
-                p.Body = msg.read<unsigned char>();
-                p.Arms = msg.read<unsigned short>();
-                p.Boots = msg.read<unsigned char>();
-                p.Armor = msg.read<unsigned short>();
-                p.Shield = msg.read<unsigned char>();
-                p.Weapon = msg.read<unsigned short>();
-                p.HeadColor = msg.read<unsigned char>();
-                p.BootColor = msg.read<unsigned char>();
-                p.Acc1Color = msg.read<unsigned char>();
-                p.Acc1 = msg.read<unsigned short>();
-                p.Acc2Color = msg.read<unsigned char>();
-                p.Acc2 = msg.read<unsigned short>();
-                p.Unknown = msg.read<unsigned char>();
-                p.Acc3 = msg.read<unsigned short>();
-                p.Unknown2 = msg.read<unsigned char>();
-                p.RestCloak = msg.read<unsigned char>();
-                p.Overcoat = msg.read<unsigned short>();
-                p.OvercoatColor = msg.read<unsigned char>();
-                p.SkinColor = msg.read<unsigned char>();
-                p.HideBool = msg.read<unsigned char>();
-                p.FaceShape = msg.read<unsigned char>();
-            }
-
-            msg.readByte();
-            p.Name = msg.readString8();
-            p.Hostile = p.IsHostile(game_state.hostile_players);
-
-            if (p.Name == game_state.get_username()) {
-                game_state.update_player_serial(p.Serial);
-                game_state.update_player_direction(p.Position.FacingDirection);
-                game_state.update_player_location(p.Position);
-            }
-            else 
-            {
-                game_state.player_manager.AddOrUpdate(p.Serial, p);
-            }
-        }
-        catch (const std::exception& e) {
-            std::cout << "Exception caught in ProcessPlayerPacket: " << e.what() << '\n';
-        }
-        catch (...) {
-            std::cout << "Unknown exception caught in ProcessPlayerPacket." << '\n';
-        }
-    }
-};
-
-std::optional<packet> getPacketIfFirstByte33(const packet& pkt) {
-    if (isFirstByte33(pkt)) {
-        return pkt;
-    }
-    return std::nullopt;
+    Player p;
+    p.Position.X = appearance.X;
+    p.Position.Y = appearance.Y;
+    p.Position.FacingDirection = appearance.Facing;
+    p.Serial = appearance.Serial;
+    p.Head = appearance.Head;
+    p.Form = appearance.Form;
+    p.Body = appearance.Body;
+    p.Arms = appearance.Arms;
+    p.Boots = appearance.Boots;
+    p.Armor = appearance.Armor;
+    p.Shield = appearance.Shield;
+    p.Weapon = appearance.Weapon;
+    p.HeadColor = appearance.HeadColor;
+    p.BootColor = appearance.BootColor;
+    p.Acc1Color = appearance.Acc1Color;
+    p.Acc1 = appearance.Acc1;
+    p.Acc2Color = appearance.Acc2Color;
+    p.Acc2 = appearance.Acc2;
+    p.Unknown = appearance.Unknown;
+    p.Acc3 = appearance.Acc3;
+    p.Unknown2 = appearance.Unknown2;
+    p.RestCloak = appearance.RestCloak;
+    p.Overcoat = appearance.Overcoat;
+    p.OvercoatColor = appearance.OvercoatColor;
+    p.SkinColor = appearance.SkinColor;
+    p.HideBool = appearance.HideBool;
+    p.FaceShape = appearance.FaceShape;
+    p.Name = appearance.Name;
+    p.Hostile = p.IsHostile(game_state.hostile_players);
+
+    game_state.player_manager.AddOrUpdate(p.Serial, p);
 }
 
-extern void recv_handle_packet_x33(const packet& packet) {
-    auto optionalPacket = getPacketIfFirstByte33(packet);
-    optionalPacket.has_value()
-		? PacketProcessor<true>::process(optionalPacket.value())
-		: PacketProcessor<false>::process(packet);
+extern bool recv_is_self_x33(const packet& packet) {
+    LazyPlayerAppearance lazy(packet);
+    return lazy.ok() && lazy.name() == game_state.get_username();
 }